@@ -1,10 +1,14 @@
 #include "AsyncHTTPGETClient.hpp"
+#include "config.hpp"
 
+#include <cstdlib>
 #include <stdexcept>
 
-/* Error message, and received data */
-static char errorBuffer[CURL_ERROR_SIZE];
-static std::string buffer;
+struct AsyncHTTPGETClient::Socket {
+	uv_poll_t poll;
+	curl_socket_t fd;
+	AsyncHTTPGETClient * cli;
+};
 
 /* Writer function for libCURL */
 static int writer(char * data, std::size_t size, std::size_t nmemb,
@@ -12,110 +16,241 @@ static int writer(char * data, std::size_t size, std::size_t nmemb,
 	if (writerData == nullptr) {
 		return 0;
 	}
-	
+
 	writerData->append(data, size * nmemb);
-	
+
 	return size * nmemb;
 }
 
+static std::string get_host(const std::string & url) {
+	size_t start = url.find("://");
+	start = start == std::string::npos ? 0 : start + 3;
+	const size_t end = url.find_first_of(":/?#", start);
+	return url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+}
+
 AsyncHTTPGETClient::Request::Request(const std::string & url, const std::string & postFields,
                                      const std::function<void(CURL * const, const CURLcode, const std::string &)> callback)
 : url(url),
   postFields(postFields),
   callback(callback) { }
 
-AsyncHTTPGETClient::AsyncHTTPGETClient()
-: curl(curl_easy_init()),
-  terminateThread(false),
-  requestThread([this] { processRequests(); }) {
-	CURLcode code;
+AsyncHTTPGETClient::Transfer::Transfer(const Request & req, const std::string & host)
+: req(req),
+  host(host),
+  curl(curl_easy_init()) {
 	if (curl == nullptr) {
 		throw std::runtime_error("Couldn't initialize libCURL!");
 	}
-	
-	if (curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer) != CURLE_OK) {
-		throw std::runtime_error("Couldn't set the libCURL error buffer!");
+	errorBuffer[0] = '\0';
+
+	std::string url = req.url;
+	if (req.postFields.size() > 0) {
+		url += "?" + req.postFields;
 	}
-	
-	code = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writer);
-	if (code != CURLE_OK) {
-		throw std::runtime_error("Couldn't set the libCURL writer function! " + std::string(errorBuffer));
+
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writer);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+	/* Signals would interrupt the loop, name lookups can't time out without them though */
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 4L);
+}
+
+AsyncHTTPGETClient::Transfer::~Transfer() {
+	curl_easy_cleanup(curl);
+}
+
+AsyncHTTPGETClient::AsyncHTTPGETClient()
+: AsyncHTTPGETClient(uv_default_loop()) { }
+
+AsyncHTTPGETClient::AsyncHTTPGETClient(uv_loop_t * const loop)
+: loop(loop),
+  multi(nullptr) {
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+	multi = curl_multi_init();
+	if (multi == nullptr) {
+		throw std::runtime_error("Couldn't initialize libCURL!");
 	}
-	
-	code = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
-	if (code != CURLE_OK) {
-		throw std::runtime_error("Couldn't set the libCURL write buffer! " + std::string(errorBuffer));
+
+	timeout_hdl = (uv_timer_t *)std::malloc(sizeof(uv_timer_t));
+	if (timeout_hdl == nullptr) {
+		throw std::bad_alloc();
 	}
-	
-	//curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 4);
+	uv_timer_init(loop, timeout_hdl);
+	timeout_hdl->data = this;
+
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, &socketCallback);
+	curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, &timerCallback);
+	curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
 }
 
 AsyncHTTPGETClient::~AsyncHTTPGETClient() {
-	terminateThread = true;
-	cv.notify_all();
-	requestThread.join();
-	if (curl) {
-		curl_easy_cleanup(curl);
+	for (auto & t : transfers) {
+		curl_multi_remove_handle(multi, t.curl);
 	}
+	transfers.clear();
+	curl_multi_cleanup(multi);
+	uv_close((uv_handle_t *)timeout_hdl, (uv_close_cb)([](uv_handle_t * const hdl){
+		std::free(hdl);
+	}));
+	curl_global_cleanup();
 }
 
 void AsyncHTTPGETClient::removeRequests(const std::string & url) {
-	/* Iterating queues isn't the best thing one can do */
-	queueLock.lock();
-	size_t queueSize = requestQueue.size();
-	while (queueSize--) {
-		Request req = requestQueue.front();
-		requestQueue.pop();
-		if (req.url != url) {
-			requestQueue.push(req);
+	for (auto & host : waiting) {
+		std::deque<Request> keep;
+		for (auto & req : host.second) {
+			if (req.url != url) {
+				keep.push_back(req);
+			}
+		}
+		host.second.swap(keep);
+	}
+	for (auto it = transfers.begin(); it != transfers.end();) {
+		if (it->req.url == url) {
+			stop(it++);
+		} else {
+			++it;
 		}
 	}
-	queueLock.unlock();
 }
 
 void AsyncHTTPGETClient::queueRequest(const AsyncHTTPGETClient::Request req) {
-	std::unique_lock<std::mutex> lck(waitLock);
-	queueLock.lock();
-	requestQueue.push(req);
-	queueLock.unlock();
-	cv.notify_all();
-}
-
-void AsyncHTTPGETClient::processRequests() {
-	while (!terminateThread) {
-		std::unique_lock<std::mutex> lck(waitLock);
-		queueLock.lock(); /* Seems like this needs too much (un)locking for my tastes */
-		while (requestQueue.size() != 0) {
-			CURLcode code;
-			
-			Request req = requestQueue.front();
-			requestQueue.pop();
-			
-			queueLock.unlock();
-			
-			std::string url = req.url;
-			if (req.postFields.size() > 0) {
-				url += "?" + req.postFields;
-			}
-			
-			curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-			
-			code = curl_easy_perform(curl);
-			
-			/* NOTE: This is called from the request thread. */
-			req.callback(curl, code, buffer);
-			buffer.clear();
-			
-			queueLock.lock();
+	const std::string host(get_host(req.url));
+	if (running[host] < SERVER_HTTP_MAX_PER_HOST) {
+		start(req, host);
+	} else {
+		waiting[host].push_back(req);
+	}
+}
+
+void AsyncHTTPGETClient::start(const Request & req, const std::string & host) {
+	transfers.emplace_back(req, host);
+	++running[host];
+	/* Sets a timeout right away, the transfer starts from the loop */
+	curl_multi_add_handle(multi, transfers.back().curl);
+}
+
+/* Removes a transfer without calling it back */
+void AsyncHTTPGETClient::stop(const std::list<Transfer>::iterator it) {
+	const std::string host(it->host);
+	curl_multi_remove_handle(multi, it->curl);
+	transfers.erase(it);
+	release(host);
+}
+
+/* A transfer of this host ended, the next waiting one takes its place */
+void AsyncHTTPGETClient::release(const std::string & host) {
+	--running[host];
+	const auto search = waiting.find(host);
+	if (search != waiting.end() && !search->second.empty()) {
+		const Request next(search->second.front());
+		search->second.pop_front();
+		start(next, host);
+		return;
+	}
+	if (search != waiting.end()) {
+		waiting.erase(search);
+	}
+	if (running[host] == 0) {
+		running.erase(host);
+	}
+}
+
+void AsyncHTTPGETClient::checkDone() {
+	CURLMsg * msg;
+	int left;
+	while ((msg = curl_multi_info_read(multi, &left)) != nullptr) {
+		if (msg->msg != CURLMSG_DONE) {
+			continue;
+		}
+		CURL * const curl = msg->easy_handle;
+		const CURLcode code = msg->data.result;
+		auto it = transfers.begin();
+		while (it != transfers.end() && it->curl != curl) {
+			++it;
+		}
+		if (it == transfers.end()) {
+			continue;
+		}
+		/* Kept out of the list, the callback could queue or remove requests */
+		std::list<Transfer> done;
+		done.splice(done.begin(), transfers, it);
+		curl_multi_remove_handle(multi, curl);
+		release(done.front().host);
+		const Transfer & t = done.front();
+		t.req.callback(t.curl, code, t.buffer);
+	}
+}
+
+int AsyncHTTPGETClient::socketCallback(CURL * const, const curl_socket_t fd, const int action, void * const clip, void * const sockp) {
+	AsyncHTTPGETClient * const cli = (AsyncHTTPGETClient *)clip;
+	Socket * sock = (Socket *)sockp;
+	if (action == CURL_POLL_REMOVE) {
+		if (sock != nullptr) {
+			curl_multi_assign(cli->multi, fd, nullptr);
+			uv_poll_stop(&sock->poll);
+			uv_close((uv_handle_t *)&sock->poll, (uv_close_cb)([](uv_handle_t * const hdl){
+				delete (Socket *)hdl->data;
+			}));
+		}
+		return 0;
+	}
+	if (sock == nullptr) {
+		sock = new Socket();
+		sock->fd = fd;
+		sock->cli = cli;
+		uv_poll_init_socket(cli->loop, &sock->poll, fd);
+		sock->poll.data = sock;
+		curl_multi_assign(cli->multi, fd, sock);
+	}
+	int events = 0;
+	if (action & CURL_POLL_IN) {
+		events |= UV_READABLE;
+	}
+	if (action & CURL_POLL_OUT) {
+		events |= UV_WRITABLE;
+	}
+	uv_poll_start(&sock->poll, events, (uv_poll_cb)&pollCallback);
+	return 0;
+}
+
+int AsyncHTTPGETClient::timerCallback(CURLM * const, const long timeout_ms, void * const clip) {
+	AsyncHTTPGETClient * const cli = (AsyncHTTPGETClient *)clip;
+	if (timeout_ms < 0) {
+		uv_timer_stop(cli->timeout_hdl);
+	} else {
+		/* Even with 0, curl doesn't want to be called back from here */
+		uv_timer_start(cli->timeout_hdl, (uv_timer_cb)&timeoutCallback, timeout_ms, 0);
+	}
+	return 0;
+}
+
+void AsyncHTTPGETClient::pollCallback(uv_poll_t * const hdl, const int status, const int events) {
+	Socket * const sock = (Socket *)hdl->data;
+	AsyncHTTPGETClient * const cli = sock->cli;
+	int flags = 0;
+	if (status < 0) {
+		flags = CURL_CSELECT_ERR;
+	} else {
+		if (events & UV_READABLE) {
+			flags |= CURL_CSELECT_IN;
+		}
+		if (events & UV_WRITABLE) {
+			flags |= CURL_CSELECT_OUT;
 		}
-		
-		queueLock.unlock();
-		
-		cv.wait(lck);
 	}
+	int running;
+	curl_multi_socket_action(cli->multi, sock->fd, flags, &running);
+	cli->checkDone();
 }
 
-CURL * const AsyncHTTPGETClient::getCurl() {
-	return curl;
+void AsyncHTTPGETClient::timeoutCallback(uv_timer_t * const hdl) {
+	AsyncHTTPGETClient * const cli = (AsyncHTTPGETClient *)hdl->data;
+	int running;
+	curl_multi_socket_action(cli->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+	cli->checkDone();
 }
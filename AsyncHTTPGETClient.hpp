@@ -1,14 +1,17 @@
 #pragma once
 
 #include <string>
-#include <atomic>
-#include <thread>
-#include <queue>
-#include <mutex>
-#include <condition_variable>
+#include <list>
+#include <deque>
+#include <unordered_map>
 #include <functional>
+#include <cstdint>
+#include <uv.h>
 #include <curl/curl.h>
 
+/* Runs requests concurrently on a loop with the curl multi interface, at most
+ * SERVER_HTTP_MAX_PER_HOST at once per host, the others wait in order.
+ * Not thread safe: use it from the loop thread, callbacks are called there. */
 class AsyncHTTPGETClient {
 public:
 	class Request {
@@ -16,29 +19,48 @@ public:
 		const std::string url;
 		const std::string postFields;
 		const std::function<void(CURL * const, const CURLcode, const std::string &)> callback;
-		
+
 		Request(const std::string & url, const std::string & postFields,
 		        const std::function<void(CURL * const, const CURLcode, const std::string &)> callback);
 	};
-	
+
 private:
-	CURL * const curl;
-	std::queue<Request> requestQueue;
-	std::mutex queueLock;
-	std::mutex waitLock;
-	std::condition_variable cv;
-	std::atomic<bool> terminateThread;
-	std::thread requestThread;
-	
+	struct Transfer {
+		const Request req;
+		const std::string host;
+		CURL * const curl;
+		std::string buffer;
+		char errorBuffer[CURL_ERROR_SIZE];
+
+		Transfer(const Request & req, const std::string & host);
+		~Transfer();
+	};
+	struct Socket;
+
+	uv_loop_t * const loop;
+	CURLM * multi;
+	uv_timer_t * timeout_hdl;
+	std::list<Transfer> transfers; /* Running */
+	std::unordered_map<std::string, std::deque<Request>> waiting; /* By host */
+	std::unordered_map<std::string, uint32_t> running; /* By host */
+
 public:
 	AsyncHTTPGETClient();
+	AsyncHTTPGETClient(uv_loop_t * const);
 	~AsyncHTTPGETClient();
-	
+
+	/* Drops the waiting and running requests to this url, their callbacks aren't called */
 	void removeRequests(const std::string & url);
 	void queueRequest(const Request);
-	
-	CURL * const getCurl();
-	
+
 private:
-	void processRequests();
+	void start(const Request &, const std::string & host);
+	void stop(const std::list<Transfer>::iterator);
+	void release(const std::string & host);
+	void checkDone();
+
+	static int socketCallback(CURL * const, const curl_socket_t, const int action, void * const cli, void * const sock);
+	static int timerCallback(CURLM * const, const long timeout_ms, void * const cli);
+	static void pollCallback(uv_poll_t * const, const int status, const int events);
+	static void timeoutCallback(uv_timer_t * const);
 };
@@ -0,0 +1,137 @@
+#include "IpReputation.hpp"
+
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+
+/* File: magic, then entries of key (16 byte IPv6 address + kind), verdict and expiry time */
+static const char magic[8] = {'O', 'W', 'O', 'P', 'R', 'E', 'P', 1};
+static const size_t keysize = 17;
+
+IpReputation::IpReputation(const size_t limit)
+: limit(limit > 0 ? limit : 1),
+  hits(0),
+  misses(0),
+  expired(0),
+  evicted(0) { }
+
+/* IPv4 addresses are stored mapped to IPv6 (::ffff:a.b.c.d) */
+bool IpReputation::make_key(const std::string& ip, const Kind kind, std::string& key) {
+	uint8_t addr[16] = {0};
+	if (inet_pton(AF_INET, ip.c_str(), &addr[12]) == 1) {
+		addr[10] = addr[11] = 0xFF;
+	} else if (inet_pton(AF_INET6, ip.c_str(), addr) != 1) {
+		return false;
+	}
+	key.assign((char *)addr, sizeof(addr));
+	key.push_back((char)kind);
+	return true;
+}
+
+bool IpReputation::get(const std::string& ip, const Kind kind, uint8_t& verdict) {
+	std::string key;
+	if (!make_key(ip, kind, key)) {
+		return false;
+	}
+	std::lock_guard<std::mutex> lck(cacheLock);
+	const auto search = entries.find(key);
+	if (search == entries.end()) {
+		++misses;
+		return false;
+	}
+	if (search->second->expires <= std::time(nullptr)) {
+		lru.erase(search->second);
+		entries.erase(search);
+		++expired;
+		++misses;
+		return false;
+	}
+	++hits;
+	lru.splice(lru.begin(), lru, search->second);
+	verdict = search->second->verdict;
+	return true;
+}
+
+void IpReputation::set(const std::string& ip, const Kind kind, const uint8_t verdict, const uint32_t ttl) {
+	std::string key;
+	if (!make_key(ip, kind, key)) {
+		return;
+	}
+	std::lock_guard<std::mutex> lck(cacheLock);
+	insert(key, verdict, std::time(nullptr) + ttl);
+}
+
+void IpReputation::insert(const std::string& key, const uint8_t verdict, const int64_t expires) {
+	const auto search = entries.find(key);
+	if (search != entries.end()) {
+		search->second->verdict = verdict;
+		search->second->expires = expires;
+		lru.splice(lru.begin(), lru, search->second);
+		return;
+	}
+	if (lru.size() >= limit) {
+		entries.erase(lru.back().key);
+		lru.pop_back();
+		++evicted;
+	}
+	lru.push_front({key, verdict, expires});
+	entries[key] = lru.begin();
+}
+
+size_t IpReputation::load(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	char hdr[sizeof(magic)];
+	if (!file.read(hdr, sizeof(hdr)) || memcmp(hdr, magic, sizeof(magic))) {
+		return 0;
+	}
+	std::lock_guard<std::mutex> lck(cacheLock);
+	const int64_t now = std::time(nullptr);
+	char rec[keysize + 1 + sizeof(int64_t)];
+	/* Saved most recently used first, inserting them in reverse keeps that order */
+	std::list<entry_t> read;
+	while (file.read(rec, sizeof(rec))) {
+		int64_t expires;
+		memcpy(&expires, &rec[keysize + 1], sizeof(expires));
+		if (expires > now) {
+			read.push_front({std::string(rec, keysize), (uint8_t)rec[keysize], expires});
+		}
+	}
+	for (const auto& e : read) {
+		insert(e.key, e.verdict, e.expires);
+	}
+	return read.size();
+}
+
+bool IpReputation::save(const std::string& path) {
+	const std::string tmp(path + ".tmp");
+	std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+	file.write(magic, sizeof(magic));
+	{
+		std::lock_guard<std::mutex> lck(cacheLock);
+		const int64_t now = std::time(nullptr);
+		char rec[keysize + 1 + sizeof(int64_t)];
+		for (const auto& e : lru) {
+			if (e.expires <= now) {
+				continue;
+			}
+			memcpy(rec, e.key.data(), keysize);
+			rec[keysize] = (char)e.verdict;
+			memcpy(&rec[keysize + 1], &e.expires, sizeof(e.expires));
+			file.write(rec, sizeof(rec));
+		}
+	}
+	file.close();
+	if (!file || std::rename(tmp.c_str(), path.c_str()) != 0) {
+		std::cerr << "Couldn't save the IP reputations to " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+IpReputation::Stats IpReputation::get_stats() {
+	std::lock_guard<std::mutex> lck(cacheLock);
+	return {lru.size(), limit, hits, misses, expired, evicted};
+}
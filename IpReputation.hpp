@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+
+/* Results of external IP lookups (proxy checks, captchas), so reconnecting clients
+ * don't trigger them again. Entries expire after their TTL, and the least recently
+ * used one is dropped when the limit is reached. Keyed by binary address. */
+class IpReputation {
+public:
+	enum Kind : uint8_t {
+		PROXY_CHECK = 0, /* 1 if it's a proxy */
+		CAPTCHA = 1 /* 1 if a captcha was solved */
+	};
+
+	struct Stats {
+		size_t size;
+		size_t limit;
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t expired;
+		uint64_t evicted;
+	};
+
+private:
+	struct entry_t {
+		std::string key;
+		uint8_t verdict;
+		int64_t expires; /* Unix time, so it can be saved */
+	};
+
+	std::mutex cacheLock;
+	std::list<entry_t> lru; /* Most recently used first */
+	std::unordered_map<std::string, std::list<entry_t>::iterator> entries;
+	const size_t limit;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t expired;
+	uint64_t evicted;
+
+public:
+	IpReputation(const size_t limit);
+
+	/* Thread safe. False if there's no fresh result for this IP. */
+	bool get(const std::string& ip, const Kind, uint8_t& verdict);
+	void set(const std::string& ip, const Kind, const uint8_t verdict, const uint32_t ttl);
+
+	/* Expired entries are skipped, returns how many were read */
+	size_t load(const std::string& path);
+	bool save(const std::string& path);
+
+	Stats get_stats();
+
+private:
+	static bool make_key(const std::string& ip, const Kind, std::string& key);
+	void insert(const std::string& key, const uint8_t verdict, const int64_t expires);
+};
@@ -0,0 +1,208 @@
+#include "IpSet.hpp"
+
+#include <arpa/inet.h>
+#include <cstring>
+
+static const uint8_t v4prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+
+static inline uint8_t bit(const uint8_t * const addr, const uint8_t i) {
+	return addr[i >> 3] >> (7 - (i & 7)) & 1;
+}
+
+/* How many leading bits are equal, up to 'max' */
+static uint8_t common_bits(const uint8_t * const a, const uint8_t * const b, const uint8_t max) {
+	uint8_t i = 0;
+	while (i < max && a[i >> 3] == b[i >> 3] && i + 8 <= max) {
+		i += 8;
+	}
+	while (i < max && bit(a, i) == bit(b, i)) {
+		i++;
+	}
+	return i;
+}
+
+static void mask(uint8_t * const addr, const uint8_t len) {
+	for (uint8_t i = 0; i < 16; i++) {
+		const int keep = len - i * 8;
+		if (keep <= 0) {
+			addr[i] = 0;
+		} else if (keep < 8) {
+			addr[i] &= 0xFF << (8 - keep);
+		}
+	}
+}
+
+IpSet::IpSet()
+: count(0) { }
+
+bool IpSet::parse(const std::string& range, uint8_t (&addr)[16], uint8_t& len) {
+	const size_t slash = range.find('/');
+	const std::string ip(range.substr(0, slash));
+	int bits = -1;
+	if (slash != std::string::npos) {
+		const std::string suffix(range.substr(slash + 1));
+		if (suffix.empty() || suffix.size() > 3 || suffix.find_first_not_of("0123456789") != std::string::npos) {
+			return false;
+		}
+		bits = std::stoi(suffix);
+	}
+	if (inet_pton(AF_INET, ip.c_str(), &addr[12]) == 1) {
+		if (bits > 32) {
+			return false;
+		}
+		memcpy(addr, v4prefix, sizeof(v4prefix));
+		len = 96 + (bits < 0 ? 32 : bits);
+	} else if (inet_pton(AF_INET6, ip.c_str(), addr) == 1) {
+		if (bits > 128) {
+			return false;
+		}
+		len = bits < 0 ? 128 : bits;
+	} else {
+		return false;
+	}
+	mask(addr, len);
+	return true;
+}
+
+std::string IpSet::format(const node_t& n) {
+	char str[INET6_ADDRSTRLEN];
+	if (n.len >= 96 && memcmp(n.addr, v4prefix, sizeof(v4prefix)) == 0) {
+		inet_ntop(AF_INET, &n.addr[12], str, sizeof(str));
+		return n.len == 128 ? std::string(str) : std::string(str) + "/" + std::to_string(n.len - 96);
+	}
+	inet_ntop(AF_INET6, n.addr, str, sizeof(str));
+	return n.len == 128 ? std::string(str) : std::string(str) + "/" + std::to_string(n.len);
+}
+
+bool IpSet::valid(const std::string& range) {
+	uint8_t addr[16];
+	uint8_t len;
+	return parse(range, addr, len);
+}
+
+bool IpSet::add(const std::string& range) {
+	uint8_t addr[16];
+	uint8_t len;
+	if (!parse(range, addr, len)) {
+		return false;
+	}
+	std::unique_ptr<node_t> * slot = &root;
+	std::unique_ptr<node_t> leaf(new node_t());
+	memcpy(leaf->addr, addr, sizeof(addr));
+	leaf->len = len;
+	leaf->terminal = true;
+	while (true) {
+		node_t * const n = slot->get();
+		if (n == nullptr) {
+			*slot = std::move(leaf);
+			break;
+		}
+		const uint8_t common = common_bits(n->addr, addr, n->len < len ? n->len : len);
+		if (common == n->len && n->len == len) {
+			if (n->terminal) {
+				return false;
+			}
+			n->terminal = true;
+			break;
+		}
+		if (common == n->len) {
+			/* 'n' contains the new range */
+			slot = &n->child[bit(addr, n->len)];
+			continue;
+		}
+		if (common == len) {
+			/* The new range contains 'n' */
+			leaf->child[bit(n->addr, len)] = std::move(*slot);
+			*slot = std::move(leaf);
+			break;
+		}
+		/* They differ at bit 'common', a node splits them there */
+		std::unique_ptr<node_t> split(new node_t());
+		memcpy(split->addr, addr, sizeof(addr));
+		mask(split->addr, common);
+		split->len = common;
+		split->terminal = false;
+		split->child[bit(n->addr, common)] = std::move(*slot);
+		split->child[bit(addr, common)] = std::move(leaf);
+		*slot = std::move(split);
+		break;
+	}
+	++count;
+	return true;
+}
+
+bool IpSet::erase(std::unique_ptr<node_t>& slot, const uint8_t (&addr)[16], const uint8_t len) {
+	node_t * const n = slot.get();
+	if (n == nullptr || n->len > len || common_bits(n->addr, addr, n->len) < n->len) {
+		return false;
+	}
+	if (n->len == len) {
+		if (!n->terminal) {
+			return false;
+		}
+		n->terminal = false;
+	} else if (!erase(n->child[bit(addr, n->len)], addr, len)) {
+		return false;
+	}
+	/* Nodes that don't split anything anymore are replaced by their child */
+	if (!n->terminal && (!n->child[0] || !n->child[1])) {
+		std::unique_ptr<node_t> next(std::move(n->child[0] ? n->child[0] : n->child[1]));
+		slot = std::move(next);
+	}
+	return true;
+}
+
+bool IpSet::remove(const std::string& range) {
+	uint8_t addr[16];
+	uint8_t len;
+	if (!parse(range, addr, len) || !erase(root, addr, len)) {
+		return false;
+	}
+	--count;
+	return true;
+}
+
+bool IpSet::contains(const std::string& ip) const {
+	uint8_t addr[16];
+	uint8_t len;
+	if (!parse(ip, addr, len)) {
+		return false;
+	}
+	const node_t * n = root.get();
+	while (n != nullptr && n->len <= len && common_bits(n->addr, addr, n->len) == n->len) {
+		if (n->terminal) {
+			return true;
+		}
+		if (n->len == 128) {
+			break;
+		}
+		n = n->child[bit(addr, n->len)].get();
+	}
+	return false;
+}
+
+size_t IpSet::size() const {
+	return count;
+}
+
+void IpSet::clear() {
+	root.reset();
+	count = 0;
+}
+
+void IpSet::walk(const node_t& n, const std::function<void(const std::string&)>& fn) {
+	if (n.terminal) {
+		fn(format(n));
+	}
+	for (const auto& c : n.child) {
+		if (c) {
+			walk(*c, fn);
+		}
+	}
+}
+
+void IpSet::for_each(const std::function<void(const std::string&)>& fn) const {
+	if (root) {
+		walk(*root, fn);
+	}
+}
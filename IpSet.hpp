@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <cstdint>
+
+/* Set of addresses and CIDR ranges ("1.2.3.4", "10.0.0.0/8", "2001:db8::/64"),
+ * in a path compressed binary trie. IPv4 is stored mapped to IPv6 (::ffff:0:0/96),
+ * so a lookup takes at most 128 steps whatever the size. Not thread safe. */
+class IpSet {
+	struct node_t {
+		uint8_t addr[16]; /* Bits past 'len' are zero */
+		uint8_t len;
+		bool terminal; /* False for nodes only splitting two branches */
+		std::unique_ptr<node_t> child[2];
+	};
+
+	std::unique_ptr<node_t> root;
+	size_t count;
+
+public:
+	IpSet();
+
+	/* False if it's already in the set or isn't valid */
+	bool add(const std::string& range);
+	/* Only removes that exact range, not the addresses or ranges inside it */
+	bool remove(const std::string& range);
+	/* True if the address is inside any of the ranges */
+	bool contains(const std::string& ip) const;
+
+	size_t size() const;
+	void clear();
+	void for_each(const std::function<void(const std::string&)>&) const;
+
+	static bool valid(const std::string& range);
+
+private:
+	static bool parse(const std::string& range, uint8_t (&addr)[16], uint8_t& len);
+	static std::string format(const node_t&);
+	static bool erase(std::unique_ptr<node_t>& slot, const uint8_t (&addr)[16], const uint8_t len);
+	static void walk(const node_t&, const std::function<void(const std::string&)>&);
+};
@@ -0,0 +1,99 @@
+#include "RegionCache.hpp"
+#include "config.hpp"
+
+#include <sys/resource.h>
+
+RegionCache::RegionCache(const size_t limit)
+: limit(limit > 0 ? limit : 1),
+  hits(0),
+  opens(0),
+  closes(0) { }
+
+size_t RegionCache::fd_budget() {
+	struct rlimit rl;
+	size_t fds = 1024;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+		fds = rl.rlim_cur;
+	}
+	fds /= SERVER_REGION_FD_DIVISOR;
+	return fds < SERVER_MIN_REGION_FDS ? SERVER_MIN_REGION_FDS : fds;
+}
+
+std::shared_ptr<RegionFile> RegionCache::get(const std::string& path, const bool create) {
+	std::lock_guard<std::mutex> lck(cacheLock);
+	const auto search = files.find(path);
+	if (search != files.end()) {
+		++hits;
+		lru.splice(lru.begin(), lru, search->second);
+		return search->second->second;
+	}
+	std::shared_ptr<RegionFile> file;
+	const auto hsearch = held.find(path);
+	if (hsearch != held.end()) {
+		/* Still open somewhere, opening it again would make two copies of its state */
+		file = hsearch->second.lock();
+		held.erase(hsearch);
+		if (file) {
+			++hits;
+			lru.emplace_front(path, file);
+			files[path] = lru.begin();
+			return file;
+		}
+		++closes;
+	}
+	make_room();
+	file.reset(RegionFile::open(path, create));
+	if (!file) {
+		return file;
+	}
+	++opens;
+	lru.emplace_front(path, file);
+	files[path] = lru.begin();
+	return file;
+}
+
+void RegionCache::drop(const std::string& path) {
+	std::lock_guard<std::mutex> lck(cacheLock);
+	const auto search = files.find(path);
+	if (search != files.end()) {
+		lru.erase(search->second);
+		files.erase(search);
+		++closes;
+	}
+	held.erase(path);
+}
+
+RegionCache::Stats RegionCache::get_stats() {
+	std::lock_guard<std::mutex> lck(cacheLock);
+	prune_held();
+	return {lru.size() + held.size(), limit, hits, opens, closes};
+}
+
+void RegionCache::prune_held() {
+	for (auto it = held.begin(); it != held.end();) {
+		if (it->second.expired()) {
+			it = held.erase(it);
+			++closes;
+		} else {
+			++it;
+		}
+	}
+}
+
+void RegionCache::make_room() {
+	if (lru.size() + held.size() < limit) {
+		return;
+	}
+	prune_held();
+	while (!lru.empty() && lru.size() + held.size() >= limit) {
+		const entry_t& victim = lru.back();
+		files.erase(victim.first);
+		/* Only the cache can hand out new references, so 1 means nobody else has it */
+		if (victim.second.use_count() > 1) {
+			held.emplace(victim.first, victim.second);
+		} else {
+			++closes;
+		}
+		lru.pop_back();
+	}
+}
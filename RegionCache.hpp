@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+
+#include "RegionFile.hpp"
+
+/* Open region files of every world, limited by a process wide budget.
+ * The least recently used file is closed when the budget is reached, unless it's
+ * still used (by a Database's unsynced set, a disk job or an old world instance):
+ * then it's only moved to 'held', still counted, and closed with its last user. */
+class RegionCache {
+public:
+	struct Stats {
+		size_t open;
+		size_t limit;
+		uint64_t hits;
+		uint64_t opens;
+		uint64_t closes;
+	};
+
+private:
+	typedef std::pair<std::string, std::shared_ptr<RegionFile>> entry_t;
+
+	std::mutex cacheLock;
+	std::list<entry_t> lru; /* Most recently used first */
+	std::unordered_map<std::string, std::list<entry_t>::iterator> files;
+	/* Evicted while used, so there's never a second RegionFile for one path */
+	std::unordered_map<std::string, std::weak_ptr<RegionFile>> held;
+	const size_t limit;
+	uint64_t hits;
+	uint64_t opens;
+	uint64_t closes;
+
+public:
+	RegionCache(const size_t limit);
+
+	/* Size the budget from RLIMIT_NOFILE */
+	static size_t fd_budget();
+
+	/* Thread safe. Every user of a path gets the same RegionFile, which locks itself */
+	std::shared_ptr<RegionFile> get(const std::string& path, const bool create);
+	/* Thread safe, forgets a file that was removed so the next get() opens it again */
+	void drop(const std::string& path);
+
+	Stats get_stats();
+
+private:
+	/* Forgets the held files that were closed, with cacheLock held */
+	void prune_held();
+	/* Evicts until a new file fits the budget, or only used files are left */
+	void make_room();
+};
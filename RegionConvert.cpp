@@ -0,0 +1,128 @@
+/* Rewrites every version 1 region file of the given world directories (or of the
+ * worlds in them, like chunkdata/) as version 2, on all cores. The server does the
+ * same to each file on its first write, this is for migrating everything at once.
+ * With -c every file is compacted instead (see RegionFile::compact), like /compact.
+ * Run it while the server is stopped.
+ *   make convert && ./pxrconvert [-c] chunkdata */
+
+#include "RegionFile.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <stdexcept>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static bool is_region(const std::string& name) {
+	return name.size() > 6 && name.compare(0, 2, "r.") == 0 && name.compare(name.size() - 4, 4, ".pxr") == 0;
+}
+
+static void find_regions(const std::string& dir, std::vector<std::string>& found, const bool recurse) {
+	DIR * const d = opendir(dir.c_str());
+	if (!d) {
+		std::cerr << "Could not open '" << dir << "'! (" << strerror(errno) << ")" << std::endl;
+		return;
+	}
+	while (const dirent * const e = readdir(d)) {
+		const std::string name(e->d_name);
+		if (name == "." || name == "..") {
+			continue;
+		}
+		const std::string path(dir + "/" + name);
+		struct stat st;
+		if (stat(path.c_str(), &st) == -1) {
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			if (recurse) {
+				find_regions(path, found, false);
+			}
+		} else if (is_region(name)) {
+			found.push_back(path);
+		}
+	}
+	closedir(d);
+}
+
+/* The world's background color as stored in chunks, from its props.txt */
+static uint32_t read_bgclr(const std::string& file) {
+	std::ifstream props(file.substr(0, file.find_last_of('/') + 1) + "props.txt");
+	std::string prop;
+	uint32_t bgclr = 0xFFFFFF;
+	while (std::getline(props, prop)) {
+		if (prop.compare(0, 8, "bgcolor ") == 0) {
+			try {
+				bgclr = stoul(prop.substr(8), nullptr, 16);
+			} catch(const std::invalid_argument&) {
+			} catch(const std::out_of_range&) { }
+		}
+	}
+	return (bgclr & 0xFF) << 16 | (bgclr & 0xFF00) | (bgclr & 0xFF0000) >> 16;
+}
+
+int main(int argc, char * argv[]) {
+	const bool compact = argc > 1 && strcmp(argv[1], "-c") == 0;
+	if (argc < (compact ? 3 : 2)) {
+		std::cerr << "Usage: " << argv[0] << " [-c] <world or chunkdata directory>..." << std::endl;
+		return 1;
+	}
+	std::vector<std::string> files;
+	for (int i = compact ? 2 : 1; i < argc; i++) {
+		find_regions(argv[i], files, true);
+	}
+	std::atomic<size_t> next(0);
+	std::atomic<size_t> converted(0);
+	std::atomic<size_t> failed(0);
+	std::atomic<uint64_t> before(0);
+	std::atomic<uint64_t> after(0);
+	std::atomic<uint32_t> dropped(0);
+	const unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::thread> workers;
+	for (unsigned int t = 0; t < threads; t++) {
+		workers.emplace_back([&] {
+			for (size_t i; (i = next++) < files.size();) {
+				const std::unique_ptr<RegionFile> file(RegionFile::open(files[i], false));
+				if (!file) {
+					std::cerr << "Could not open '" << files[i] << "'! (" << strerror(errno) << ")" << std::endl;
+					++failed;
+					continue;
+				}
+				if (!compact && !file->is_legacy()) {
+					continue;
+				}
+				const size_t oldsize = file->get_size();
+				uint32_t filedropped = 0;
+				if (!(compact ? file->compact(read_bgclr(files[i]), filedropped) : file->upgrade())) {
+					std::cerr << "Could not convert '" << files[i] << "'! (" << strerror(errno) << ")" << std::endl;
+					++failed;
+					continue;
+				}
+				before += oldsize;
+				dropped += filedropped;
+				if (compact && file->is_empty() && unlink(files[i].c_str()) == 0) {
+					/* Chunks missing from the disk are empty */
+					++converted;
+					continue;
+				}
+				after += file->get_size();
+				++converted;
+			}
+		});
+	}
+	for (std::thread& t : workers) {
+		t.join();
+	}
+	std::cout << (compact ? "Compacted " : "Converted ") << converted << " of " << files.size() << " region files on "
+		<< threads << " threads, " << before << " -> " << after << " bytes, " << dropped << " empty chunks removed, "
+		<< failed << " failed." << std::endl;
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,394 @@
+#include "RegionFile.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/* Mapping grows in steps of this many bytes, the file itself grows one slot at a time */
+#define REGION_MAP_GROW_BYTES (64 * 1024)
+
+static uint32_t get32(const uint8_t * const p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put32(uint8_t * const p, const uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+RegionFile::RegionFile(const std::string& path, const int fd)
+: path(path),
+  fd(fd),
+  map(nullptr),
+  size(0),
+  capacity(0),
+  legacy(false) { }
+
+RegionFile::~RegionFile() {
+	if (map) {
+		munmap(map, capacity);
+	}
+	close(fd);
+}
+
+RegionFile * RegionFile::open(const std::string& path, const bool create) {
+	const int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+	if (fd == -1) {
+		return nullptr;
+	}
+	RegionFile * const file = new RegionFile(path, fd);
+	if (!file->load()) {
+		const int err = errno;
+		delete file;
+		errno = err;
+		return nullptr;
+	}
+	return file;
+}
+
+bool RegionFile::load() {
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		return false;
+	}
+	size = st.st_size;
+	uint8_t magic[4];
+	legacy = size > 0 && (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || get32(magic) != MAGIC);
+	const size_t minsize = legacy ? LEGACY_LOOKUP_SIZE : DATA_START;
+	if (size < minsize) {
+		/* New (or truncated) file, the lookup table must always exist */
+		if (ftruncate(fd, minsize) == -1) {
+			return false;
+		}
+		size = minsize;
+	}
+	capacity = size + REGION_MAP_GROW_BYTES;
+	void * const newmap = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (newmap == MAP_FAILED) {
+		return false;
+	}
+	map = (uint8_t *)newmap;
+	used.clear();
+	if (legacy) {
+		return true;
+	}
+	if (get32(map) != MAGIC) {
+		put32(map, MAGIC);
+	}
+	used.resize(size / UNIT_SIZE, false);
+	mark(0, DATA_START / UNIT_SIZE, true);
+	for (uint32_t i = 0; i < 1024; i++) {
+		const uint32_t entry = get32(map + HEADER_SIZE + i * 4);
+		if (in_file(entry)) {
+			mark(entry >> 8, entry & 0xFF, true);
+		}
+	}
+	return true;
+}
+
+uint32_t RegionFile::lookup_index(const int32_t x, const int32_t y) {
+	return (x & 31) + (y & 31) * 32;
+}
+
+uint32_t RegionFile::get_entry(const int32_t x, const int32_t y) const {
+	return get32(map + HEADER_SIZE + lookup_index(x, y) * 4);
+}
+
+void RegionFile::set_entry(const int32_t x, const int32_t y, const uint32_t entry) {
+	put32(map + HEADER_SIZE + lookup_index(x, y) * 4, entry);
+}
+
+bool RegionFile::in_file(const uint32_t entry) const {
+	const size_t unit = entry >> 8;
+	const size_t units = entry & 0xFF;
+	return units > 0 && unit >= DATA_START / UNIT_SIZE && unit + units <= used.size();
+}
+
+bool RegionFile::read_legacy(const int32_t x, const int32_t y, char * const arr) const {
+	const uint8_t * const lookup = map + lookup_index(x, y) * 3;
+	const uint32_t chunkpos = lookup[0] << 8 | lookup[1] << 16 | (uint32_t)lookup[2] << 24;
+	if (chunkpos < LEGACY_LOOKUP_SIZE || chunkpos > size || size - chunkpos < CHUNK_SIZE) {
+		return false;
+	}
+	memcpy(arr, map + chunkpos, CHUNK_SIZE);
+	return true;
+}
+
+bool RegionFile::read_chunk(const int32_t x, const int32_t y, char * const arr) const {
+	std::lock_guard<std::mutex> lck(filelock);
+	return decode(x, y, arr);
+}
+
+bool RegionFile::decode(const int32_t x, const int32_t y, char * const arr) const {
+	if (legacy) {
+		return read_legacy(x, y, arr);
+	}
+	const uint32_t entry = get_entry(x, y);
+	if (!in_file(entry)) {
+		return false;
+	}
+	const uint8_t * const rec = map + (entry >> 8) * UNIT_SIZE;
+	const size_t len = rec[0] | rec[1] << 8;
+	if (len > (entry & 0xFF) * UNIT_SIZE - RECORD_HEADER_SIZE
+			|| get32(rec + 4) != crc32c(crc32c(0, rec, 4), rec + RECORD_HEADER_SIZE, len)) {
+		/* Corrupted */
+		errno = EBADMSG;
+		return false;
+	}
+	switch (rec[2]) {
+		case RAW:
+			if (len != CHUNK_SIZE) {
+				return false;
+			}
+			memcpy(arr, rec + RECORD_HEADER_SIZE, CHUNK_SIZE);
+			return true;
+		case ZLIB: {
+			uLongf out = CHUNK_SIZE;
+			return uncompress((Bytef *)arr, &out, rec + RECORD_HEADER_SIZE, len) == Z_OK && out == CHUNK_SIZE;
+		}
+	}
+	return false;
+}
+
+size_t RegionFile::encode(const char * const arr, uint8_t * const out) {
+	/* Stored raw if compressing doesn't make it smaller */
+	uLongf len = CHUNK_SIZE - 1;
+	uint8_t type = ZLIB;
+	if (compress2(out + RECORD_HEADER_SIZE, &len, (const Bytef *)arr, CHUNK_SIZE, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		type = RAW;
+		len = CHUNK_SIZE;
+		memcpy(out + RECORD_HEADER_SIZE, arr, CHUNK_SIZE);
+	}
+	out[0] = len;
+	out[1] = len >> 8;
+	out[2] = type;
+	out[3] = 0;
+	put32(out + 4, crc32c(crc32c(0, out, 4), out + RECORD_HEADER_SIZE, len));
+	return RECORD_HEADER_SIZE + len;
+}
+
+size_t RegionFile::units_for(const size_t bytes) {
+	return (bytes + UNIT_SIZE - 1) / UNIT_SIZE;
+}
+
+size_t RegionFile::page_fit(const size_t unit, const size_t units) {
+	const size_t perpage = SLOT_ALIGN / UNIT_SIZE;
+	if (unit % perpage + units > perpage) {
+		return (unit / perpage + 1) * perpage;
+	}
+	return unit;
+}
+
+void RegionFile::mark(const size_t unit, const size_t units, const bool state) {
+	for (size_t i = unit; i < unit + units; i++) {
+		used[i] = state;
+	}
+}
+
+size_t RegionFile::alloc(const size_t units) {
+	/* First fit */
+	size_t unit = page_fit(DATA_START / UNIT_SIZE, units);
+	while (unit + units <= used.size()) {
+		size_t free = 0;
+		while (free < units && !used[unit + free]) {
+			++free;
+		}
+		if (free == units) {
+			return unit;
+		}
+		unit = page_fit(unit + free + 1, units);
+	}
+	unit = page_fit(used.size(), units);
+	/* Offsets are stored in 24 bits */
+	if (unit + units >= 1 << 24 || !grow((unit + units) * UNIT_SIZE)) {
+		return 0;
+	}
+	return unit;
+}
+
+bool RegionFile::grow(const size_t newsize) {
+	if (newsize > capacity) {
+		const size_t newcapacity = newsize + REGION_MAP_GROW_BYTES;
+		void * const newmap = mremap(map, capacity, newcapacity, MREMAP_MAYMOVE);
+		if (newmap == MAP_FAILED) {
+			return false;
+		}
+		map = (uint8_t *)newmap;
+		capacity = newcapacity;
+	}
+	if (ftruncate(fd, newsize) == -1) {
+		return false;
+	}
+	size = newsize;
+	if (!legacy) {
+		used.resize(size / UNIT_SIZE, false);
+	}
+	return true;
+}
+
+bool RegionFile::write_chunk(const int32_t x, const int32_t y, const char * const arr) {
+	std::lock_guard<std::mutex> lck(filelock);
+	uint32_t dropped;
+	if (legacy && !rewrite(false, 0, dropped)) {
+		return false;
+	}
+	uint8_t rec[RECORD_HEADER_SIZE + CHUNK_SIZE];
+	const size_t len = encode(arr, rec);
+	const size_t units = units_for(len);
+	/* The old copy is kept until the entry points to the new one */
+	const size_t unit = alloc(units);
+	if (unit == 0) {
+		return false;
+	}
+	memcpy(map + unit * UNIT_SIZE, rec, len);
+	const uint32_t old = get_entry(x, y);
+	set_entry(x, y, unit << 8 | units);
+	mark(unit, units, true);
+	if (in_file(old)) {
+		mark(old >> 8, old & 0xFF, false);
+	}
+	return true;
+}
+
+bool RegionFile::sync() {
+	/* Also writes the pages changed through the mapping, without using it (it can move) */
+	return fdatasync(fd) == 0;
+}
+
+bool RegionFile::is_legacy() const {
+	std::lock_guard<std::mutex> lck(filelock);
+	return legacy;
+}
+
+size_t RegionFile::get_size() const {
+	std::lock_guard<std::mutex> lck(filelock);
+	return size;
+}
+
+bool RegionFile::upgrade() {
+	std::lock_guard<std::mutex> lck(filelock);
+	if (!legacy) {
+		return true;
+	}
+	uint32_t dropped;
+	return rewrite(false, 0, dropped);
+}
+
+bool RegionFile::compact(const uint32_t bgclr, uint32_t& dropped) {
+	std::lock_guard<std::mutex> lck(filelock);
+	dropped = 0;
+	return rewrite(true, bgclr, dropped);
+}
+
+bool RegionFile::is_empty() const {
+	std::lock_guard<std::mutex> lck(filelock);
+	if (legacy) {
+		for (size_t i = 0; i < LEGACY_LOOKUP_SIZE; i++) {
+			if (map[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+	return std::find(used.begin() + DATA_START / UNIT_SIZE, used.end(), true) == used.end();
+}
+
+bool RegionFile::rewrite(const bool dropbg, const uint32_t bgclr, uint32_t& dropped) {
+	std::vector<uint8_t> image(DATA_START, 0);
+	put32(image.data(), MAGIC);
+	char data[CHUNK_SIZE];
+	char bg[CHUNK_SIZE];
+	for (size_t i = 0; i < CHUNK_SIZE; i++) {
+		bg[i] = (char) (bgclr >> ((i % 3) * 8));
+	}
+	uint8_t rec[RECORD_HEADER_SIZE + CHUNK_SIZE];
+	for (uint32_t i = 0; i < 1024; i++) {
+		/* Z order, chunks near each other on the canvas share pages */
+		int32_t x = 0;
+		int32_t y = 0;
+		for (int b = 0; b < 5; b++) {
+			x |= (i >> (2 * b) & 1) << b;
+			y |= (i >> (2 * b + 1) & 1) << b;
+		}
+		/* Corrupted chunks are left out too, they read as missing anyway */
+		if (!decode(x, y, data)) {
+			continue;
+		}
+		if (dropbg && memcmp(data, bg, CHUNK_SIZE) == 0) {
+			++dropped;
+			continue;
+		}
+		const size_t len = encode(data, rec);
+		const size_t units = units_for(len);
+		const size_t unit = page_fit(image.size() / UNIT_SIZE, units);
+		image.resize((unit + units) * UNIT_SIZE, 0);
+		memcpy(image.data() + unit * UNIT_SIZE, rec, len);
+		put32(image.data() + HEADER_SIZE + lookup_index(x, y) * 4, unit << 8 | units);
+	}
+	/* Written next to it and renamed over it, a crash leaves one of the two whole */
+	const std::string tmp(path + ".tmp");
+	const int newfd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (newfd == -1) {
+		return false;
+	}
+	size_t done = 0;
+	while (done < image.size()) {
+		const ssize_t n = ::write(newfd, image.data() + done, image.size() - done);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	if (done != image.size() || fdatasync(newfd) == -1 || rename(tmp.c_str(), path.c_str()) == -1) {
+		const int err = errno;
+		close(newfd);
+		unlink(tmp.c_str());
+		errno = err;
+		return false;
+	}
+	const std::string dir(path.substr(0, path.find_last_of('/') + 1));
+	const int dirfd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd != -1) {
+		fsync(dirfd);
+		close(dirfd);
+	}
+	/* Same descriptor number, now for the new file */
+	const bool ok = dup2(newfd, fd) != -1;
+	close(newfd);
+	if (!ok) {
+		return false;
+	}
+	munmap(map, capacity);
+	map = nullptr;
+	return load();
+}
+
+uint32_t RegionFile::crc32c(uint32_t crc, const uint8_t * data, size_t len) {
+	static const struct table_t {
+		uint32_t t[256];
+		table_t() {
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++) {
+					c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+				}
+				t[i] = c;
+			}
+		}
+	} table;
+	crc = ~crc;
+	while (len--) {
+		crc = table.t[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+/* A .pxr region file (32x32 chunks), accessed through a shared memory mapping.
+ * Version 2 layout: a 256 byte header starting with MAGIC, 1024 lookup entries of
+ * 4 bytes (offset in 256 byte units << 8 | units used, 0 = not saved), then the chunks.
+ * Each chunk is a record (size, type, CRC32C of the data) followed by its zlib
+ * compressed (or raw) data, in a slot that never crosses a 4 KiB page. Slots of
+ * rewritten chunks are reused, compact() packs the rest.
+ * Version 1 files (3 byte entries, raw 768 byte slots, no header) are read as they
+ * are, and rewritten as version 2 on their first write.
+ * Thread safe: one file can be shared by every Database of a world (old instances
+ * of a reloaded world still read from it), so calls are serialized by 'filelock'. */
+class RegionFile {
+	const std::string path;
+	const int fd; /* Kept by upgrade(), so sync() can run meanwhile */
+	uint8_t * map;
+	size_t size; /* Bytes used by the file */
+	size_t capacity; /* Bytes mapped, always >= size */
+	bool legacy; /* Version 1 */
+	std::vector<bool> used; /* Units holding the header or a chunk, version 2 only */
+	/* Guards all of the above but 'fd', writes can move or replace the mapping */
+	mutable std::mutex filelock;
+
+	RegionFile(const std::string& path, const int fd);
+
+public:
+	static const size_t CHUNK_SIZE = 768;
+	static const size_t LEGACY_LOOKUP_SIZE = 3072;
+	static const size_t UNIT_SIZE = 256;
+	static const size_t SLOT_ALIGN = 4096; /* Slots never cross a multiple of it */
+	static const size_t HEADER_SIZE = 256;
+	static const size_t DATA_START = HEADER_SIZE + 1024 * 4;
+	static const size_t RECORD_HEADER_SIZE = 8; /* Data size, type, unused, CRC32C */
+	static const uint32_t MAGIC = 0x32525850; /* "PXR2" */
+
+	enum record_type : uint8_t {
+		RAW = 0,
+		ZLIB = 1
+	};
+
+	~RegionFile();
+
+	/* Returns nullptr (and sets errno) if the file couldn't be opened or created */
+	static RegionFile * open(const std::string& path, const bool create);
+
+	bool read_chunk(const int32_t x, const int32_t y, char * const arr) const;
+	bool write_chunk(const int32_t x, const int32_t y, const char * const arr);
+	/* Waits until the written chunks are on the disk, without taking the lock */
+	bool sync();
+
+	bool is_legacy() const;
+	size_t get_size() const;
+	/* Rewrites a version 1 file as version 2, replacing it atomically */
+	bool upgrade();
+	/* Rewrites the file with its chunks packed in Z order, leaving out the ones filled
+	 * with 'bgclr' (as in Chunk, red in the low byte). Replaced atomically too. */
+	bool compact(const uint32_t bgclr, uint32_t& dropped);
+	/* Has no chunks */
+	bool is_empty() const;
+
+	/* Like zlib's crc32(), with the Castagnoli polynomial */
+	static uint32_t crc32c(uint32_t crc, const uint8_t * data, size_t len);
+
+private:
+	bool load();
+	bool rewrite(const bool dropbg, const uint32_t bgclr, uint32_t& dropped);
+	static uint32_t lookup_index(const int32_t x, const int32_t y);
+	uint32_t get_entry(const int32_t x, const int32_t y) const;
+	void set_entry(const int32_t x, const int32_t y, const uint32_t entry);
+	bool in_file(const uint32_t entry) const;
+	bool read_legacy(const int32_t x, const int32_t y, char * const arr) const;
+	/* read_chunk() with the lock held */
+	bool decode(const int32_t x, const int32_t y, char * const arr) const;
+	/* Writes a chunk's record to 'out', returns its size */
+	static size_t encode(const char * const arr, uint8_t * const out);
+	static size_t units_for(const size_t bytes);
+	/* First unit of a slot at or after 'unit' that stays in one page */
+	static size_t page_fit(const size_t unit, const size_t units);
+	/* Returns the first unit of a free slot, 0 if the file couldn't grow */
+	size_t alloc(const size_t units);
+	void mark(const size_t unit, const size_t units, const bool state);
+	bool grow(const size_t newsize);
+};
@@ -3,19 +3,54 @@
 #include <cstdlib>
 #include <stdexcept>
 
-TaskBuffer::TaskBuffer() {
+/* Free nodes of each producer thread, deleted when the thread exits */
+struct TaskBuffer::TaskCache {
+	Task * list;
+
+	TaskCache() : list(nullptr) { }
+
+	~TaskCache() {
+		while (list != nullptr) {
+			Task * const t = list;
+			list = t->next.load(std::memory_order_relaxed);
+			delete t;
+		}
+	}
+};
+
+std::atomic<TaskBuffer::Task *> TaskBuffer::freetasks(nullptr);
+
+thread_local TaskBuffer::TaskCache TaskBuffer::taskcache;
+
 #ifdef USE_LIBUV
+TaskBuffer::TaskBuffer()
+: TaskBuffer(uv_default_loop()) { }
+
+TaskBuffer::TaskBuffer(uv_loop_t * const loop)
+: head(&stub),
+  tail(&stub) {
+	stub.next.store(nullptr, std::memory_order_relaxed);
 	async_hdl = (uv_async_t *)std::malloc(sizeof(uv_async_t));
 	if (async_hdl == nullptr) {
 		throw std::bad_alloc();
 	}
-	uv_async_init(uv_default_loop(), async_hdl, (uv_async_cb)&asyncExecute);
+	uv_async_init(loop, async_hdl, (uv_async_cb)&asyncExecute);
 	async_hdl->data = this;
-#endif
 }
+#else
+TaskBuffer::TaskBuffer()
+: head(&stub),
+  tail(&stub) {
+	stub.next.store(nullptr, std::memory_order_relaxed);
+}
+#endif
 
 TaskBuffer::~TaskBuffer() {
-	/* Should I run remaining tasks? */
+	Task * t;
+	while ((t = pop()) != nullptr) {
+		t->invoke(t, false);
+		free_task(t);
+	}
 #ifdef USE_LIBUV
 	uv_close((uv_handle_t *)async_hdl, (uv_close_cb)([](uv_handle_t * const hdl){
 		std::free(hdl);
@@ -38,15 +73,77 @@ void TaskBuffer::asyncExecute(uv_async_t * const hdl) {
 }
 #endif
 
-void TaskBuffer::queueTask(const std::function<void(void)> & task) {
-	buflock.lock();
-	taskbuf.push_back(task);
-	buflock.unlock();
+TaskBuffer::Task * TaskBuffer::alloc_task() {
+	if (taskcache.list == nullptr) {
+		taskcache.list = freetasks.exchange(nullptr, std::memory_order_acquire);
+		if (taskcache.list == nullptr) {
+			return new Task();
+		}
+	}
+	Task * const t = taskcache.list;
+	taskcache.list = t->next.load(std::memory_order_relaxed);
+	return t;
+}
+
+void TaskBuffer::free_task(Task * const t) {
+	/* Only pushed one by one and taken all at once, so there's no ABA problem */
+	Task * top = freetasks.load(std::memory_order_relaxed);
+	do {
+		t->next.store(top, std::memory_order_relaxed);
+	} while (!freetasks.compare_exchange_weak(top, t, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void TaskBuffer::push(Task * const t) {
+	t->next.store(nullptr, std::memory_order_relaxed);
+	Task * const prev = head.exchange(t, std::memory_order_acq_rel);
+	/* Until this store the task can't be reached from 'tail' */
+	prev->next.store(t, std::memory_order_release);
+}
+
+TaskBuffer::Task * TaskBuffer::pop() {
+	Task * t = tail;
+	Task * next = t->next.load(std::memory_order_acquire);
+	if (t == &stub) {
+		if (next == nullptr) {
+			return nullptr;
+		}
+		tail = t = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+	if (next != nullptr) {
+		tail = next;
+		return t;
+	}
+	if (t != head.load(std::memory_order_acquire)) {
+		/* A producer is halfway through push(), its runTasks() will call us again */
+		return nullptr;
+	}
+	/* 't' is the last task, the stub takes its place so it can be returned */
+	push(&stub);
+	next = t->next.load(std::memory_order_acquire);
+	if (next != nullptr) {
+		tail = next;
+		return t;
+	}
+	return nullptr;
 }
 
 void TaskBuffer::executeTasks() {
-	for (auto & task : taskbuf) {
-		task();
+	/* Tasks can be queued (from other threads) while these run */
+#ifdef USE_LIBUV
+	for (size_t i = 0; i < SERVER_TASKS_PER_DRAIN; i++) {
+#else
+	while (true) {
+#endif
+		Task * const t = pop();
+		if (t == nullptr) {
+			return;
+		}
+		t->invoke(t, true);
+		free_task(t);
 	}
-	taskbuf.clear();
+#ifdef USE_LIBUV
+	/* Let the loop handle other events, the rest run on the next iteration */
+	uv_async_send(async_hdl);
+#endif
 }
@@ -4,28 +4,106 @@
 #include <uv.h>
 #endif
 
-#include <functional>
-#include <vector>
-#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
 
+#include "config.hpp"
+
+/* Tasks can be queued from any thread, they run on the loop thread in the order
+ * each thread queued them. Lock free (intrusive MPSC queue), the task nodes are
+ * pooled and small callables are stored in them, so queueing doesn't allocate. */
 class TaskBuffer {
-	std::mutex buflock;
-	std::vector<std::function<void(void)>> taskbuf;
+	struct Task {
+		std::atomic<Task *> next;
+		/* Runs the callable if asked to, then destroys it */
+		void (*invoke)(Task * const, const bool run);
+		alignas(std::max_align_t) unsigned char data[SERVER_TASK_INLINE_SIZE];
+	};
+	struct TaskCache;
+
+	std::atomic<Task *> head; /* Last queued task, producers swap themselves in */
+	Task * tail; /* Next task to run, only touched by the loop */
+	Task stub;
 #ifdef USE_LIBUV
 	uv_async_t * async_hdl;
 #endif
-	
+
+	/* Nodes freed by the loops, producers take the whole list at once */
+	static std::atomic<Task *> freetasks;
+	static thread_local TaskCache taskcache;
+
 public:
 	TaskBuffer();
-	~TaskBuffer();
-	
 #ifdef USE_LIBUV
-	/* This will make the tasks execute in the main thread */
+	/* Tasks run on the thread of this loop instead of the default one */
+	TaskBuffer(uv_loop_t * const);
+#endif
+	~TaskBuffer(); /* Tasks still queued are dropped */
+
+#ifdef USE_LIBUV
+	/* This will make the tasks execute in the loop thread */
 	static void asyncExecute(uv_async_t * const);
 #endif
 	void runTasks();
-	void queueTask(const std::function<void(void)> &); /* Thread safe */
-	
+	/* Thread safe */
+	template<typename F>
+	void queueTask(F&& fn);
+
 private:
+	template<typename T, typename F>
+	static void store(Task * const, F&& fn, std::true_type /* fits in the node */);
+	template<typename T, typename F>
+	static void store(Task * const, F&& fn, std::false_type);
+	template<typename T>
+	static void invoke_inline(Task * const, const bool run);
+	template<typename T>
+	static void invoke_boxed(Task * const, const bool run);
+
+	static Task * alloc_task();
+	static void free_task(Task * const);
+	void push(Task * const);
+	Task * pop();
 	void executeTasks();
 };
+
+template<typename F>
+void TaskBuffer::queueTask(F&& fn) {
+	typedef typename std::decay<F>::type T;
+	Task * const t = alloc_task();
+	store<T>(t, std::forward<F>(fn), std::integral_constant<bool,
+		sizeof(T) <= SERVER_TASK_INLINE_SIZE && alignof(T) <= alignof(std::max_align_t)>());
+	push(t);
+}
+
+template<typename T, typename F>
+void TaskBuffer::store(Task * const t, F&& fn, std::true_type) {
+	new (t->data) T(std::forward<F>(fn));
+	t->invoke = &invoke_inline<T>;
+}
+
+template<typename T, typename F>
+void TaskBuffer::store(Task * const t, F&& fn, std::false_type) {
+	new (t->data) T *(new T(std::forward<F>(fn)));
+	t->invoke = &invoke_boxed<T>;
+}
+
+template<typename T>
+void TaskBuffer::invoke_inline(Task * const t, const bool run) {
+	T * const fn = reinterpret_cast<T *>(t->data);
+	if (run) {
+		(*fn)();
+	}
+	fn->~T();
+}
+
+template<typename T>
+void TaskBuffer::invoke_boxed(Task * const t, const bool run) {
+	T * const fn = *reinterpret_cast<T **>(t->data);
+	if (run) {
+		(*fn)();
+	}
+	delete fn;
+}
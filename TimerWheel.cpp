@@ -0,0 +1,153 @@
+#include "TimerWheel.hpp"
+
+#include <cstdlib>
+#include <new>
+
+TimerWheel::Timer::Timer(void (*cb)(Timer * const), void * const data)
+: prev(nullptr),
+  next(nullptr),
+  wheel(nullptr),
+  expires(0),
+  cb(cb),
+  data(data) { }
+
+TimerWheel::Timer::~Timer() {
+	if (wheel != nullptr) {
+		wheel->cancel(this);
+	}
+}
+
+bool TimerWheel::Timer::is_scheduled() const {
+	return wheel != nullptr;
+}
+
+TimerWheel::TimerWheel(uv_loop_t * const loop, const uint32_t tickms)
+: tickms(tickms > 0 ? tickms : 1),
+  current(0),
+  start(uv_now(loop)),
+  count(0) {
+	tick_hdl = (uv_timer_t *)std::malloc(sizeof(uv_timer_t));
+	if (tick_hdl == nullptr) {
+		throw std::bad_alloc();
+	}
+	uv_timer_init(loop, tick_hdl);
+	tick_hdl->data = this;
+	for (auto& level : slots) {
+		for (Timer& head : level) {
+			head.prev = head.next = &head;
+		}
+	}
+}
+
+TimerWheel::~TimerWheel() {
+	for (auto& level : slots) {
+		for (Timer& head : level) {
+			while (head.next != &head) {
+				Timer * const t = head.next;
+				unlink(t);
+				t->wheel = nullptr;
+			}
+		}
+	}
+	uv_timer_stop(tick_hdl);
+	uv_close((uv_handle_t *)tick_hdl, (uv_close_cb)([](uv_handle_t * const hdl){
+		std::free(hdl);
+	}));
+}
+
+void TimerWheel::schedule(Timer * const t, const uint64_t ms) {
+	if (t->wheel == this) {
+		unlink(t);
+	} else {
+		if (t->wheel != nullptr) {
+			t->wheel->cancel(t);
+		}
+		if (count++ == 0) {
+			/* Nothing was waiting, so the wheel can jump to the current time */
+			current = (uv_now(tick_hdl->loop) - start) / tickms;
+			uv_timer_start(tick_hdl, (uv_timer_cb)&tick, tickms, tickms);
+		}
+		t->wheel = this;
+	}
+	const uint64_t maxticks = ((uint64_t)1 << (LEVEL_BITS * LEVELS)) - 1;
+	uint64_t ticks = (ms + tickms - 1) / tickms;
+	ticks = ticks < 1 ? 1 : ticks > maxticks ? maxticks : ticks;
+	/* 'current' falls behind while the loop is busy, it catches up on the next tick */
+	const uint64_t now = (uv_now(tick_hdl->loop) - start) / tickms;
+	t->expires = (now > current ? now : current) + ticks;
+	if (t->expires - current > maxticks) {
+		t->expires = current + maxticks;
+	}
+	link(t);
+}
+
+void TimerWheel::cancel(Timer * const t) {
+	if (t->wheel != this) {
+		return;
+	}
+	unlink(t);
+	t->wheel = nullptr;
+	if (--count == 0) {
+		uv_timer_stop(tick_hdl);
+	}
+}
+
+uint32_t TimerWheel::size() const {
+	return count;
+}
+
+void TimerWheel::link(Timer * const t) {
+	const uint64_t delta = t->expires - current;
+	uint32_t level = 0;
+	while (level < LEVELS - 1 && delta >= (uint64_t)1 << (LEVEL_BITS * (level + 1))) {
+		level++;
+	}
+	Timer * const head = &slots[level][(t->expires >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+	t->prev = head;
+	t->next = head->next;
+	head->next->prev = t;
+	head->next = t;
+}
+
+void TimerWheel::unlink(Timer * const t) {
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->prev = t->next = nullptr;
+}
+
+void TimerWheel::advance() {
+	++current;
+	/* Each time a level wraps around, the next slot of the level above moves down */
+	for (uint32_t level = 1; level < LEVELS; level++) {
+		if (current & (((uint64_t)1 << (LEVEL_BITS * level)) - 1)) {
+			break;
+		}
+		Timer * const head = &slots[level][(current >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+		while (head->next != head) {
+			Timer * const t = head->next;
+			unlink(t);
+			link(t);
+		}
+	}
+	/* Callbacks can schedule, cancel or delete any timer */
+	Timer * const head = &slots[0][current & (SLOTS - 1)];
+	while (head->next != head) {
+		Timer * const t = head->next;
+		unlink(t);
+		t->wheel = nullptr;
+		--count;
+		t->cb(t);
+	}
+}
+
+void TimerWheel::tick(uv_timer_t * const hdl) {
+	TimerWheel * const w = (TimerWheel *)hdl->data;
+	/* Catches up if the loop was busy for more than a tick */
+	const uint64_t now = (uv_now(hdl->loop) - w->start) / w->tickms;
+	while (w->current < now && w->count > 0) {
+		w->advance();
+	}
+	if (w->count == 0) {
+		uv_timer_stop(hdl);
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <uv.h>
+
+/* Timers for many objects on one loop, with a single uv_timer ticking while any
+ * are scheduled. Levels of 64 slots each cover 64x the time of the previous one,
+ * timers move down a level as their time gets near. Scheduling, rescheduling and
+ * cancelling are O(1). Not thread safe, use it from the loop's thread. */
+class TimerWheel {
+public:
+	static const uint32_t LEVEL_BITS = 6;
+	static const uint32_t LEVELS = 4;
+	static const uint32_t SLOTS = 1 << LEVEL_BITS;
+
+	/* Embedded in the object it's for, unlinks itself if destroyed while scheduled */
+	class Timer {
+		friend class TimerWheel;
+		Timer * prev;
+		Timer * next;
+		TimerWheel * wheel; /* Set while scheduled */
+		uint64_t expires; /* In ticks */
+
+	public:
+		void (*cb)(Timer * const);
+		void * data;
+
+		Timer(void (*cb)(Timer * const) = nullptr, void * const data = nullptr);
+		~Timer();
+
+		bool is_scheduled() const;
+	};
+
+private:
+	uv_timer_t * tick_hdl;
+	const uint32_t tickms;
+	uint64_t current; /* Last tick run */
+	uint64_t start; /* Loop time of tick 0 */
+	uint32_t count;
+	Timer slots[LEVELS][SLOTS]; /* List heads */
+
+public:
+	TimerWheel(uv_loop_t * const, const uint32_t tickms);
+	~TimerWheel();
+
+	/* Runs the timer's callback in 'ms' (rounded up to the next tick), or moves it there */
+	void schedule(Timer * const, const uint64_t ms);
+	void cancel(Timer * const);
+	uint32_t size() const;
+
+private:
+	void link(Timer * const);
+	static void unlink(Timer * const);
+	void advance();
+	static void tick(uv_timer_t * const);
+};
@@ -0,0 +1,52 @@
+#include "WorkerPool.hpp"
+
+WorkerPool::WorkerPool(const unsigned int threads)
+: stopping(false) {
+	for (unsigned int i = 0; i < (threads ? threads : 1); i++) {
+		workers.emplace_back([this] { processJobs(); });
+	}
+}
+
+WorkerPool::~WorkerPool() {
+	stop();
+}
+
+void WorkerPool::queueJob(const std::function<void(void)> & work, const std::function<void(void)> & done, TaskBuffer * const doneq) {
+	std::unique_lock<std::mutex> lck(queueLock);
+	jobs.push({work, done, doneq});
+	cv.notify_one();
+}
+
+void WorkerPool::stop() {
+	{
+		std::unique_lock<std::mutex> lck(queueLock);
+		if (stopping) {
+			return;
+		}
+		stopping = true;
+		cv.notify_all();
+	}
+	for (auto & t : workers) {
+		t.join();
+	}
+	workers.clear();
+}
+
+void WorkerPool::processJobs() {
+	std::unique_lock<std::mutex> lck(queueLock);
+	while (true) {
+		cv.wait(lck, [this] { return stopping || !jobs.empty(); });
+		if (stopping) {
+			break;
+		}
+		Job job = jobs.front();
+		jobs.pop();
+		lck.unlock();
+
+		job.work();
+		job.doneq->queueTask(job.done);
+		job.doneq->runTasks();
+
+		lck.lock();
+	}
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "TaskBuffer.hpp"
+
+/* Runs blocking jobs (disk reads) on a set of threads,
+ * their completion callbacks run on the loop of the caller. */
+class WorkerPool {
+	struct Job {
+		std::function<void(void)> work;
+		std::function<void(void)> done;
+		TaskBuffer * doneq;
+	};
+
+	std::mutex queueLock;
+	std::condition_variable cv;
+	std::queue<Job> jobs;
+	std::vector<std::thread> workers;
+	bool stopping;
+
+public:
+	WorkerPool(const unsigned int threads);
+	~WorkerPool();
+
+	/* work runs on a worker thread, then done runs on the loop of doneq */
+	void queueJob(const std::function<void(void)> & work, const std::function<void(void)> & done, TaskBuffer * const doneq);
+	/* Joins the workers, queued jobs and pending completions are dropped */
+	void stop();
+
+private:
+	void processJobs();
+};
@@ -0,0 +1,254 @@
+#include "WriteAheadLog.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/* Type, position, data, CRC32 of all of it */
+static const size_t HEADER_SIZE = 1 + 4 + 4;
+static const size_t CRC_SIZE = 4;
+static const size_t CHUNK_DATA_SIZE = 16 * 16 * 3;
+
+WriteAheadLog::WriteAheadLog(const std::string& dir, const int fd, const uint64_t segment)
+: dir(dir),
+  fd(fd),
+  segment(segment),
+  generation(0) { }
+
+WriteAheadLog::~WriteAheadLog() {
+	close(fd);
+}
+
+std::string WriteAheadLog::segment_path(const std::string& dir, const uint64_t segment) {
+	return dir + "wal." + std::to_string(segment) + ".bin";
+}
+
+std::vector<uint64_t> WriteAheadLog::segments(const std::string& dir) {
+	std::vector<uint64_t> found;
+	DIR * const d = opendir(dir.c_str());
+	if (d == nullptr) {
+		return found;
+	}
+	while (const dirent * const e = readdir(d)) {
+		const char * const name = e->d_name;
+		if (strncmp(name, "wal.", 4) != 0 || name[4] < '0' || name[4] > '9') {
+			continue;
+		}
+		char * end;
+		const uint64_t n = strtoull(name + 4, &end, 10);
+		if (strcmp(end, ".bin") == 0) {
+			found.push_back(n);
+		}
+	}
+	closedir(d);
+	std::sort(found.begin(), found.end());
+	return found;
+}
+
+WriteAheadLog * WriteAheadLog::open(const std::string& dir) {
+	const std::vector<uint64_t> old(segments(dir));
+	const uint64_t segment = old.empty() ? 0 : old.back() + 1;
+	const int fd = ::open(segment_path(dir, segment).c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		return nullptr;
+	}
+	return new WriteAheadLog(dir, fd, segment);
+}
+
+size_t WriteAheadLog::record_size(const uint8_t type) {
+	switch (type) {
+		case PIXEL:
+			return HEADER_SIZE + 3 + CRC_SIZE;
+		case CHUNK:
+			return HEADER_SIZE + CHUNK_DATA_SIZE + CRC_SIZE;
+		case PROTECT:
+			return HEADER_SIZE + 1 + CRC_SIZE;
+	}
+	return 0;
+}
+
+size_t WriteAheadLog::replay(const std::string& dir, const replay_cb& fn) {
+	size_t records = 0;
+	for (const uint64_t segment : segments(dir)) {
+		const int fd = ::open(segment_path(dir, segment).c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			continue;
+		}
+		struct stat st;
+		std::vector<uint8_t> file;
+		if (fstat(fd, &st) == 0) {
+			file.resize(st.st_size);
+		}
+		size_t got = 0;
+		while (got < file.size()) {
+			const ssize_t n = read(fd, file.data() + got, file.size() - got);
+			if (n <= 0) {
+				if (n == -1 && errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			got += n;
+		}
+		close(fd);
+		size_t pos = 0;
+		while (pos < got) {
+			const uint8_t * const rec = file.data() + pos;
+			const size_t size = record_size(rec[0]);
+			if (size == 0 || got - pos < size) {
+				break;
+			}
+			uint32_t crc;
+			memcpy(&crc, rec + size - CRC_SIZE, CRC_SIZE);
+			if (crc != crc32(0, rec, size - CRC_SIZE)) {
+				break;
+			}
+			int32_t x;
+			int32_t y;
+			memcpy(&x, rec + 1, 4);
+			memcpy(&y, rec + 5, 4);
+			fn(rec[0], x, y, rec + HEADER_SIZE);
+			pos += size;
+			++records;
+		}
+	}
+	return records;
+}
+
+bool WriteAheadLog::has_records(const std::string& dir) {
+	for (const uint64_t segment : segments(dir)) {
+		struct stat st;
+		if (stat(segment_path(dir, segment).c_str(), &st) == 0 && st.st_size > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void WriteAheadLog::append(const uint8_t type, const int32_t x, const int32_t y, const void * const data, const size_t size) {
+	const size_t start = buf.size();
+	buf.resize(start + HEADER_SIZE + size + CRC_SIZE);
+	uint8_t * const rec = buf.data() + start;
+	rec[0] = type;
+	memcpy(rec + 1, &x, 4);
+	memcpy(rec + 5, &y, 4);
+	memcpy(rec + HEADER_SIZE, data, size);
+	const uint32_t crc = crc32(0, rec, HEADER_SIZE + size);
+	memcpy(rec + HEADER_SIZE + size, &crc, CRC_SIZE);
+}
+
+void WriteAheadLog::log_px(const int32_t x, const int32_t y, const uint8_t r, const uint8_t g, const uint8_t b) {
+	const uint8_t clr[3] = {r, g, b};
+	append(PIXEL, x, y, clr, sizeof(clr));
+}
+
+void WriteAheadLog::log_chunk(const int32_t x, const int32_t y, const char * const data) {
+	append(CHUNK, x, y, data, CHUNK_DATA_SIZE);
+}
+
+void WriteAheadLog::log_protect(const int32_t x, const int32_t y, const bool state) {
+	const uint8_t s = state;
+	append(PROTECT, x, y, &s, 1);
+}
+
+bool WriteAheadLog::has_pending() const {
+	return !buf.empty();
+}
+
+std::vector<uint8_t> WriteAheadLog::take(uint64_t& gen) {
+	{
+		std::lock_guard<std::mutex> lck(filelock);
+		gen = generation;
+	}
+	std::vector<uint8_t> batch;
+	batch.swap(buf);
+	return batch;
+}
+
+bool WriteAheadLog::write_all(const int fd, const std::vector<uint8_t>& batch) {
+	size_t done = 0;
+	while (done < batch.size()) {
+		const ssize_t n = ::write(fd, batch.data() + done, batch.size() - done);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		done += n;
+	}
+	return fdatasync(fd) == 0;
+}
+
+bool WriteAheadLog::write(const std::vector<uint8_t>& batch, const uint64_t gen) {
+	std::lock_guard<std::mutex> lck(filelock);
+	if (gen != generation) {
+		/* Already saved by a checkpoint */
+		return true;
+	}
+	return write_all(fd, batch);
+}
+
+bool WriteAheadLog::rotate(std::vector<uint8_t>& pending, uint64_t& oldsegment) {
+	std::lock_guard<std::mutex> lck(filelock);
+	const int newfd = ::open(segment_path(dir, segment + 1).c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (newfd == -1) {
+		return false;
+	}
+	close(fd);
+	fd = newfd;
+	oldsegment = segment++;
+	pending.clear();
+	pending.swap(buf);
+	return true;
+}
+
+bool WriteAheadLog::write_to(const uint64_t oldsegment, const std::vector<uint8_t>& batch) {
+	std::lock_guard<std::mutex> lck(filelock);
+	/* Not created again if a checkpoint removed it, its records are saved */
+	const int oldfd = ::open(segment_path(dir, oldsegment).c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (oldfd == -1) {
+		return errno == ENOENT;
+	}
+	const bool ok = write_all(oldfd, batch);
+	close(oldfd);
+	return ok;
+}
+
+bool WriteAheadLog::drop(const uint64_t oldsegment) {
+	std::lock_guard<std::mutex> lck(filelock);
+	bool ok = true;
+	for (const uint64_t s : segments(dir)) {
+		if (s <= oldsegment && s != segment && unlink(segment_path(dir, s).c_str()) == -1) {
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+bool WriteAheadLog::checkpoint() {
+	std::lock_guard<std::mutex> lck(filelock);
+	++generation;
+	buf.clear();
+	bool ok = true;
+	for (const uint64_t s : segments(dir)) {
+		if (s != segment && unlink(segment_path(dir, s).c_str()) == -1) {
+			ok = false;
+		}
+	}
+	/* Old records replayed over newer saved chunks would undo them, so this has to stick */
+	const int dirfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1 || fsync(dirfd) == -1) {
+		ok = false;
+	}
+	if (dirfd != -1) {
+		close(dirfd);
+	}
+	return ok && ftruncate(fd, 0) == 0 && fdatasync(fd) == 0;
+}
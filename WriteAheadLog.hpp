@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+
+/* Append-only log of a world's edits since they were last saved, replayed after a crash.
+ * Records are added on the world's loop and written in batches (take() then write(),
+ * from any thread), so many edits share one fdatasync. Each record ends with a CRC32:
+ * replay stops at the first damaged one, a torn write at the end only loses itself.
+ * The log is split in numbered files (wal.N.bin): a save in the background starts a
+ * new one with rotate(), and drops the older ones with drop() once it's on the disk. */
+class WriteAheadLog {
+public:
+	enum record_type : uint8_t {
+		PIXEL = 1, /* Pixel position, RGB */
+		CHUNK = 2, /* Chunk position, 16 * 16 * 3 bytes of data */
+		PROTECT = 3 /* Chunk position, state */
+	};
+
+	/* Position, data (after the position) */
+	typedef std::function<void(const uint8_t type, const int32_t x, const int32_t y, const uint8_t * const)> replay_cb;
+
+private:
+	const std::string dir;
+	int fd;
+	uint64_t segment; /* Number of the file being written */
+	std::mutex filelock; /* Guards the files, 'fd', 'segment' and 'generation' */
+	uint64_t generation; /* Batches taken before the last checkpoint() are dropped */
+	std::vector<uint8_t> buf; /* Records not taken yet */
+
+	WriteAheadLog(const std::string& dir, const int fd, const uint64_t segment);
+
+public:
+	~WriteAheadLog();
+
+	/* Starts a file after the ones already in 'dir'.
+	 * Returns nullptr (and sets errno) if it couldn't be created. */
+	static WriteAheadLog * open(const std::string& dir);
+	/* Reads every file in 'dir' in order, returns how many records were read */
+	static size_t replay(const std::string& dir, const replay_cb&);
+	static bool has_records(const std::string& dir);
+
+	void log_px(const int32_t x, const int32_t y, const uint8_t r, const uint8_t g, const uint8_t b);
+	void log_chunk(const int32_t x, const int32_t y, const char * const data);
+	void log_protect(const int32_t x, const int32_t y, const bool state);
+
+	bool has_pending() const;
+	/* Moves the pending records out, for write() */
+	std::vector<uint8_t> take(uint64_t& gen);
+	/* Thread safe, appends a batch and waits until it's on the disk */
+	bool write(const std::vector<uint8_t>& batch, const uint64_t gen);
+
+	/* Later records go to a new file. The pending ones belong to the old file,
+	 * they're moved to 'pending' for write_to(). No batch can be being written. */
+	bool rotate(std::vector<uint8_t>& pending, uint64_t& oldsegment);
+	/* Thread safe, appends a batch to an older file if it still exists */
+	bool write_to(const uint64_t oldsegment, const std::vector<uint8_t>& batch);
+	/* Thread safe, removes the files up to 'oldsegment', once their edits are saved */
+	bool drop(const uint64_t oldsegment);
+	/* Empties the log and drops the pending records, once everything in them was saved */
+	bool checkpoint();
+
+private:
+	void append(const uint8_t type, const int32_t x, const int32_t y, const void * const data, const size_t size);
+	static size_t record_size(const uint8_t type);
+	static std::string segment_path(const std::string& dir, const uint64_t segment);
+	static std::vector<uint64_t> segments(const std::string& dir);
+	static bool write_all(const int fd, const std::vector<uint8_t>& batch);
+};
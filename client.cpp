@@ -4,28 +4,29 @@
 
 /* Client class functions */
 
-Client::Client(const uint32_t id, uWS::WebSocket<uWS::SERVER> ws, World * const wrld, SocketInfo * si)
+Client::Client(const uint32_t id, uWS::WebSocket<uWS::SERVER> ws, World * const wrld, SocketInfo * si, const uint16_t protocol)
 		: nick(),
 		  pixupdlimit(0, 1),
 		  chatlimit(CLIENT_CHAT_RATELIMIT),
+		  idletimer(&Client::idle_timeout, this),
+		  warntimer(&Client::warn_decay, this),
 		  ws(ws),
 		  wrld(wrld),
+		  protocol(protocol),
 		  penalty(0),
 		  handledelete(true),
 		  rank(1),
 		  stealthadmin(false),
 		  suspicious(si->origin != "https://owoppa.netlify.com"),
 		  compressionEnabled(false),
-		  pos({0, 0, 0, 0, 0, 0}),
 		  lastclr({0, 0, 0}),
 		  id(id),
 		  si(si),
 		  mute(false),
+		  slot(0),
 		  chathtml(false){
 	std::cout << "(" << wrld->name << "/" << si->ip << ") New client! ID: " << id << std::endl;
-	uv_timer_init(uv_default_loop(), &idletimeout_hdl);
-	idletimeout_hdl.data = this;
-	//uv_timer_start(&idletimeout_hdl, (uv_timer_cb) &Client::idle_timeout, 300000, 1200000);
+	updated();
 	uint8_t msg[5] = {SET_ID};
 	memcpy(&msg[1], (char *)&id, sizeof(id));
 	ws.send((const char *)&msg, sizeof(msg), uWS::BINARY);
@@ -39,12 +40,45 @@ bool Client::can_edit() {
 	return pixupdlimit.can_spend();
 }
 
-void Client::get_chunk(const int32_t x, const int32_t y) const {
-	wrld->send_chunk(ws, x, y);
+void Client::get_chunk(const int32_t x, const int32_t y) {
+	subscribe(x, y);
+	wrld->send_chunk(this, x, y);
+}
+
+void Client::subscribe(const int32_t x, const int32_t y) {
+	const uint64_t chunk = key64(x, y);
+	const auto search = subscriptions.find(chunk);
+	if (search != subscriptions.end()) {
+		subscriptionorder.splice(subscriptionorder.begin(), subscriptionorder, search->second);
+		return;
+	}
+	if (subscriptions.size() >= CLIENT_MAX_SUBSCRIBED_CHUNKS) {
+		subscriptions.erase(subscriptionorder.back());
+		subscriptionorder.pop_back();
+	}
+	subscriptionorder.push_front(chunk);
+	subscriptions[chunk] = subscriptionorder.begin();
+}
+
+void Client::unsubscribe(const int32_t x, const int32_t y) {
+	const auto search = subscriptions.find(key64(x, y));
+	if (search != subscriptions.end()) {
+		subscriptionorder.erase(search->second);
+		subscriptions.erase(search);
+	}
+}
+
+bool Client::is_subscribed(const uint64_t chunk) const {
+	return subscriptions.find(chunk) != subscriptions.end();
+}
+
+const std::list<uint64_t> & Client::get_subscriptions() const {
+	return subscriptionorder;
 }
 
 void Client::put_px(const int32_t x, const int32_t y, const RGB clr) {
 		if(is_admin() || can_edit()){
+		const pinfo_t pos = get_pos();
 		uint32_t distx = (x >> 4) - (pos.x >> 8); distx *= distx;
 		uint32_t disty = (y >> 4) - (pos.y >> 8); disty *= disty;
 		const uint32_t dist = sqrt(distx + disty);
@@ -59,24 +93,37 @@ void Client::put_px(const int32_t x, const int32_t y, const RGB clr) {
 
 }
 
+void Client::put_pxs(std::vector<pixupd_t>& pxs) {
+	if(!is_admin()){
+		/* Batches can be bigger than the bucket, the pixels past the allowance
+		 * are dropped like single pixels over the limit */
+		pxs.resize(pixupdlimit.spend_up_to(pxs.size()));
+	}
+	if(pxs.size()){
+		lastclr = {pxs.back().r, pxs.back().g, pxs.back().b};
+		wrld->put_pxs(pxs, rank);
+		updated();
+	}
+}
+
 void Client::teleport(const int32_t x, const int32_t y) {
 	uint8_t msg[9] = {TELEPORT};
 	memcpy(&msg[1], (char *)&x, sizeof(x));
 	memcpy(&msg[5], (char *)&y, sizeof(y));
 	ws.send((const char *)&msg, sizeof(msg), uWS::BINARY);
+	pinfo_t pos = get_pos();
 	pos.x = (x << 4) + 8;
 	pos.y = (y << 4) + 8;
-	wrld->upd_cli(this);
+	wrld->move_cli(this, pos);
 }
 
 void Client::move(const pinfo_t& newpos) {
-	pos = newpos;
-	wrld->upd_cli(this);
+	wrld->move_cli(this, newpos);
 	updated();
 }
 
-const pinfo_t * Client::get_pos() { /* Hmmm... */
-	return &pos;
+pinfo_t Client::get_pos() const {
+	return wrld->get_pos(slot);
 }
 
 bool Client::can_chat() {
@@ -98,24 +145,40 @@ void Client::tell(const std::string& msg) {
 }
 
 void Client::updated() {
-	uv_timer_again(&idletimeout_hdl);
+	/* Just moves the timer to another slot */
+	wrld->shard->get_timers()->schedule(&idletimer, CLIENT_IDLE_TIMEOUT_MSEC);
 }
 
-void Client::idle_timeout(uv_timer_t * const t) {
-	//Client * const cl = (Client *)t->data;
-	/* Maybe there should be a proper kick function */
-	//cl->tell("Server: Kicked for inactivity.");
-	//cl->safedelete(true);
+void Client::idle_timeout(TimerWheel::Timer * const t) {
+	Client * const cl = (Client *)t->data;
+	if (cl->is_admin()) {
+		cl->updated();
+		return;
+	}
+	cl->tell("Server: Kicked for inactivity.");
+	cl->safedelete(true);
+}
+
+void Client::warn_decay(TimerWheel::Timer * const t) {
+	Client * const cl = (Client *)t->data;
+	if (cl->penalty > 0 && --cl->penalty > 0) {
+		cl->wrld->shard->get_timers()->schedule(t, CLIENT_WARN_DECAY_MSEC);
+	}
+}
+
+void Client::destroy(TimerWheel::Timer * const t) {
+	delete (Client *)t->data;
 }
 
 void Client::safedelete(const bool close) {
 	if(handledelete){
 		handledelete = false;
 		wrld->rm_cli(this);
-		uv_timer_stop(&idletimeout_hdl);
-		uv_close((uv_handle_t *)&idletimeout_hdl, (uv_close_cb)([](uv_handle_t * const t){
-			delete (Client *)t->data;
-		}));
+		TimerWheel * const timers = wrld->shard->get_timers();
+		timers->cancel(&warntimer);
+		/* Deleted on the next tick, whoever called this can still use it until then */
+		idletimer.cb = &Client::destroy;
+		timers->schedule(&idletimer, 0);
 		if(close){
 			ws.close();
 		}
@@ -123,7 +186,11 @@ void Client::safedelete(const bool close) {
 }
 
 void Client::promote(uint8_t newrank, uint16_t prate) {
+	const uint8_t oldrank = rank;
 	rank = newrank;
+	if (oldrank != rank) {
+		wrld->rank_changed(this, oldrank);
+	}
 	if (rank == ADMIN) {
 		tell("Server: You are now an admin. Do /help for a list of commands.");
 	} else if (rank == MODERATOR) {
@@ -148,6 +215,9 @@ bool Client::warn() {
 		safedelete(true);
 		return true;
 	}
+	if(!warntimer.is_scheduled()){
+		wrld->shard->get_timers()->schedule(&warntimer, CLIENT_WARN_DECAY_MSEC);
+	}
 	return false;
 }
 
@@ -184,12 +254,19 @@ uint8_t Client::get_rank() const {
 	return rank;
 }
 
+uint16_t Client::get_protocol() const {
+	return protocol;
+}
+
 void Client::set_stealth(bool new_state) {
 	stealthadmin = new_state;
 }
 
 void Client::set_nick(const std::string & name) {
+	/* The name it was indexed by, its id if it had no nick */
+	const std::string oldnick(get_nick());
 	nick = name;
+	wrld->nick_changed(this, oldnick);
 }
 
 void Client::set_pbucket(uint16_t rate, uint16_t per) {
@@ -63,6 +63,8 @@ Commands::Commands(Server * const sv) {
 		{"broadcast", std::bind(Commands::broadcast, sv, this, std::placeholders::_1, std::placeholders::_2)},
 		{"totalonline", std::bind(Commands::totalonline, sv, this, std::placeholders::_1, std::placeholders::_2)},
 		{"tellraw", std::bind(Commands::tellraw, sv, this, std::placeholders::_1, std::placeholders::_2)},
+		{"stats", std::bind(Commands::stats, sv, this, std::placeholders::_1, std::placeholders::_2)},
+		{"compact", std::bind(Commands::compact, sv, this, std::placeholders::_1, std::placeholders::_2)},
 		//{"sayraw", std::bind(Commands::sayraw, sv, this, std::placeholders::_1, std::placeholders::_2)},
     {"dev", std::bind(Commands::dev, sv, this, std::placeholders::_1, std::placeholders::_2)}
 	};
@@ -199,7 +201,7 @@ void Commands::broadcast(Server * const sv, const Commands * const cmd,
 
 void Commands::totalonline(Server * const sv, const Commands * const cmd,
 			Client * const cl, const std::vector<std::string>& args) {
-	cl->tell("Total connections to the server: " + std::to_string(sv->connsws.size()));
+	cl->tell("Total connections to the server: " + std::to_string(sv->connections.load()));
 }
 
 void Commands::tellraw(Server * const sv, const Commands * const cmd,
@@ -369,8 +371,8 @@ void Commands::teleport(Server * const sv, const Commands * const cmd,
         }
         Client * const target = cl->get_world()->get_cli(id);
         if(target) {
-            const pinfo_t * pos = target->get_pos();
-            cl->teleport(pos->x >> 4, pos->y >> 4);
+            const pinfo_t pos = target->get_pos();
+            cl->teleport(pos.x >> 4, pos.y >> 4);
         }
     } else if (args.size() == 4) {
         uint32_t id = 0;
@@ -387,9 +389,9 @@ void Commands::teleport(Server * const sv, const Commands * const cmd,
         }
         Client * const target = cl->get_world()->get_cli(id);
         if (target) {
-            pinfo_t const * const p = target->get_pos();
-            int32_t lx = p->x >> 4;
-            int32_t ly = p->y >> 4;
+            const pinfo_t p = target->get_pos();
+            int32_t lx = p.x >> 4;
+            int32_t ly = p.y >> 4;
             target->teleport(x, y);
             cl->tell("Server: Teleported " + std::to_string(id) + " from " + std::to_string(lx) + ", " + std::to_string(ly) + " to " + std::to_string(x) + ", " + std::to_string(y));
         }
@@ -468,8 +470,9 @@ void Commands::worlds(Server * const sv, const Commands * const cmd,
 			Client * const cl, const std::vector<std::string>& args) {
 	//if (args.size() == 1) {
 		cl->tell("Currently loaded worlds:");
+		std::lock_guard<std::mutex> lck(sv->worldlock);
 		for (auto & s : sv->worlds) {
-			cl->tell("-> " + s.first + " [" + std::to_string(s.second->get_pl()->size()) + "]");
+			cl->tell("-> " + s.first + " [" + std::to_string(s.second->get_online()) + "]");
 		}
 	//} else {
 		//cl->tell("Usage: /worlds list");
@@ -510,11 +513,11 @@ void Commands::lock(Server * const sv, const Commands * const cmd,
 		} else if(args[1] == "captcha") {
 			bool new_state = args[2] == "true" ? true : false;
 			sv->set_captcha_protection(new_state);
-			cl->tell("Captcha protection " + (new_state ? std::string("enabled.") : std::string("disabled.")));
+			cl->tell("Captcha protection " + (sv->captcha_required ? std::string("enabled.") : std::string("disabled.")));
 		} else if (args[1] == "proxy") {
 			bool new_state = args[2] == "true" ? true : false;
 			sv->set_proxycheck(new_state);
-			cl->tell("Proxy protection " + (new_state ? std::string("enabled.") : std::string("disabled.")));
+			cl->tell("Proxy protection " + (sv->proxy_lock ? std::string("enabled.") : std::string("disabled.")));
 		} else if (args[1] == "trustwhitelist") {
 			bool new_state = args[2] == "true" ? true : false;
 			sv->trusting_captcha = new_state;
@@ -648,12 +651,13 @@ void Commands::tell(Server * const sv, const Commands * const cmd,
 
 void Commands::bans(Server * const sv, const Commands * const cmd,
 			Client * const cl, const std::vector<std::string>& args) {
+	std::lock_guard<std::mutex> lck(sv->listlock);
 	auto * banarr = sv->getbans();
 	if (args.size() == 2) {
 		if (args[1] == "list") {
-			for (auto & ip : *banarr) {
+			banarr->for_each([cl](const std::string& ip) {
 				cl->tell("-> " + ip);
-			}
+			});
 			cl->tell("Total: " + std::to_string(banarr->size()));
 		} else if (args[1] == "clear") {
 			banarr->clear();
@@ -661,15 +665,18 @@ void Commands::bans(Server * const sv, const Commands * const cmd,
 		}
 	} else if (args.size() == 3) {
 		if (args[1] == "add") {
-			banarr->emplace(args[2]);
-			cl->tell("Banned IP: " + args[2]);
+			if (!IpSet::valid(args[2])) {
+				cl->tell("Invalid IP or range: " + args[2]);
+			} else if (banarr->add(args[2])) {
+				cl->tell("Banned IP: " + args[2]);
+			}
 		} else if (args[1] == "remove") {
-			if (banarr->erase(args[2])) {
+			if (banarr->remove(args[2])) {
 				cl->tell("Unbanned IP: " + args[2]);
 			}
 		}
 	} else {
-		cl->tell("Usage: /bans (list, clear, add, remove) [IP]");
+		cl->tell("Usage: /bans (list, clear, add, remove) [IP or range, like 1.2.3.0/24]");
 	}
 }
 
@@ -687,12 +694,13 @@ void Commands::bansuspicious(Server * const sv, const Commands * const cmd,
 
 void Commands::whitelist(Server * const sv, const Commands * const cmd,
 			Client * const cl, const std::vector<std::string>& args) {
+	std::lock_guard<std::mutex> lck(sv->listlock);
 	auto * whitelistarr = sv->getwhitelist();
 	if (args.size() == 2) {
 		if (args[1] == "list") {
-			for (auto & ip : *whitelistarr) {
+			whitelistarr->for_each([cl](const std::string& ip) {
 				cl->tell("-> " + ip);
-			}
+			});
 			cl->tell("Total: " + std::to_string(whitelistarr->size()));
 		} else if (args[1] == "clear") {
 			whitelistarr->clear();
@@ -700,15 +708,18 @@ void Commands::whitelist(Server * const sv, const Commands * const cmd,
 		}
 	} else if (args.size() == 3) {
 		if (args[1] == "add") {
-			whitelistarr->emplace(args[2]);
-			cl->tell("Whitelisted IP: " + args[2]);
+			if (!IpSet::valid(args[2])) {
+				cl->tell("Invalid IP or range: " + args[2]);
+			} else if (whitelistarr->add(args[2])) {
+				cl->tell("Whitelisted IP: " + args[2]);
+			}
 		} else if (args[1] == "remove") {
-			if (whitelistarr->erase(args[2])) {
+			if (whitelistarr->remove(args[2])) {
 				cl->tell("Unwhitelisted IP: " + args[2]);
 			}
 		}
 	} else {
-		cl->tell("Usage: /whitelist (list, clear, add, remove) [IP]");
+		cl->tell("Usage: /whitelist (list, clear, add, remove) [IP or range, like 1.2.3.0/24]");
 	}
 }
 
@@ -720,12 +731,13 @@ void Commands::spawn(Server * const sv, const Commands * const cmd,
 
 void Commands::blacklist(Server * const sv, const Commands * const cmd,
 			Client * const cl, const std::vector<std::string>& args) {
+	std::lock_guard<std::mutex> lck(sv->listlock);
 	auto * blacklistarr = sv->getblacklist();
 	if (args.size() == 2) {
 		if (args[1] == "list") {
-			for (auto & ip : *blacklistarr) {
+			blacklistarr->for_each([cl](const std::string& ip) {
 				cl->tell("-> " + ip);
-			}
+			});
 			cl->tell("Total: " + std::to_string(blacklistarr->size()));
 		} else if (args[1] == "clear") {
 			blacklistarr->clear();
@@ -733,15 +745,18 @@ void Commands::blacklist(Server * const sv, const Commands * const cmd,
 		}
 	} else if (args.size() == 3) {
 		if (args[1] == "add") {
-			blacklistarr->emplace(args[2]);
-			cl->tell("Blacklisted IP: " + args[2]);
+			if (!IpSet::valid(args[2])) {
+				cl->tell("Invalid IP or range: " + args[2]);
+			} else if (blacklistarr->add(args[2])) {
+				cl->tell("Blacklisted IP: " + args[2]);
+			}
 		} else if (args[1] == "remove") {
-			if (blacklistarr->erase(args[2])) {
+			if (blacklistarr->remove(args[2])) {
 				cl->tell("Unblacklisted IP: " + args[2]);
 			}
 		}
 	} else {
-		cl->tell("Usage: /blacklist (list, clear, add, remove) [IP]");
+		cl->tell("Usage: /blacklist (list, clear, add, remove) [IP or range, like 1.2.3.0/24]");
 	}
 }
 
@@ -831,3 +846,42 @@ void Commands::save(Server * const sv, const Commands * const cmd,
 			Client * const cl, const std::vector<std::string>& args) {
 	sv->save_now();
 }
+
+void Commands::stats(Server * const sv, const Commands * const cmd,
+			Client * const cl, const std::vector<std::string>& args) {
+	const RegionCache::Stats rs(sv->regions.get_stats());
+	cl->tell("Region files: " + std::to_string(rs.open) + "/" + std::to_string(rs.limit) + " open, "
+		+ std::to_string(rs.hits) + " hits, " + std::to_string(rs.opens) + " opened, " + std::to_string(rs.closes) + " closed");
+	const uint64_t hits = Chunk::msgcache_hits;
+	const uint64_t misses = Chunk::msgcache_misses;
+	cl->tell("Chunk frame cache: " + std::to_string(hits) + " hits, " + std::to_string(misses) + " misses ("
+		+ std::to_string(hits + misses ? hits * 100 / (hits + misses) : 0) + "% hit rate)");
+	const IpReputation::Stats ips(sv->reputation.get_stats());
+	cl->tell("IP reputation: " + std::to_string(ips.size) + "/" + std::to_string(ips.limit) + " entries, "
+		+ std::to_string(ips.hits) + " hits, " + std::to_string(ips.misses) + " misses, "
+		+ std::to_string(ips.expired) + " expired, " + std::to_string(ips.evicted) + " evicted");
+	cl->tell("Rejected on accept: " + std::to_string(sv->rejected_banned) + " banned, "
+		+ std::to_string(sv->rejected_lockdown) + " lockdown, " + std::to_string(sv->rejected_conns) + " over the IP limit, "
+		+ std::to_string(sv->rejected_fast) + " too fast");
+	cl->tell("Connection limiter: " + std::to_string(sv->iplimiter.size()) + " IPs, "
+		+ std::to_string(sv->subnetlimiter.size()) + " subnets tracked");
+	const uint64_t saved = World::chunks_saved;
+	cl->tell("Checkpoints: " + std::to_string(saved) + " chunks saved, "
+		+ std::to_string(saved ? World::save_latency_total / saved : 0) + "ms avg, "
+		+ std::to_string(World::save_latency_max) + "ms max dirty, " + std::to_string(World::chunks_queued) + " queued");
+}
+
+void Commands::compact(Server * const sv, const Commands * const cmd,
+			Client * const cl, const std::vector<std::string>& args) {
+	World * const w = cl->get_world();
+	const uint32_t id = cl->id;
+	cl->tell("Compacting the region files of '" + w->name + "'...");
+	w->compact([w, id](const bool ok, const uint64_t reclaimed, const uint32_t dropped) {
+		/* Could have left meanwhile */
+		Client * const c = w->get_cli(id);
+		if(c){
+			c->tell(std::string(ok ? "Compacted" : "Compacted with errors") + ", " + std::to_string(reclaimed)
+				+ " bytes reclaimed, " + std::to_string(dropped) + " empty chunks removed.");
+		}
+	});
+}
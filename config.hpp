@@ -3,10 +3,23 @@
  * World config
  ***/
 
-/* Will close old file handles */
-#define WORLD_MAX_FILE_HANDLES 16
 #define WORLD_MAX_CHUNKS_LOADED 2048
 
+/* Edits are appended to the world's wal.N.bin and written by the disk threads with one
+ * fdatasync this often, a crash loses at most the last interval. The log is replayed
+ * into the region files at startup (or when the world loads), and emptied on save. */
+#define WORLD_LOG_SYNC_MSEC 200
+
+/* Changed chunks are saved in the background a few at a time, oldest change first.
+ * Every tick writes up to BUDGET_BYTES of chunks that have been dirty for MIN_AGE,
+ * and all of the ones dirty for MAX_AGE, so a busy world never saves in one burst. */
+#define WORLD_CHECKPOINT_TICK_MSEC 500
+#define WORLD_CHECKPOINT_MIN_AGE_MSEC 5000
+#define WORLD_CHECKPOINT_MAX_AGE_MSEC 60000
+#define WORLD_CHECKPOINT_BUDGET_BYTES (64 * 1024)
+/* A new log file is started this often, the old ones are removed once their edits are saved */
+#define WORLD_LOG_ROTATE_MSEC 30000
+
 /* Negative and positive X and Y range of chunks allowed to be created */
 #define WORLD_MAX_CHUNK_XY 0xFFFFF
 
@@ -18,15 +31,92 @@
 #define WORLD_MAX_PLAYER_UPDATES 128
 #define WORLD_MAX_PLAYER_LEFT_UPDATES 255
 
-/* Maximum value is 65535, max pixel updates every WORLD_UPDATE_RATE_MSEC */
+/* Players are grouped in cells of (1 << N) pixels, cursors in the 3x3 cells around a player
+ * are sent every update, others only every WORLD_FAR_PLAYER_UPDATE_DIVISOR updates */
+#define WORLD_PLAYER_CELL_SHIFT 10
+#define WORLD_FAR_PLAYER_UPDATE_DIVISOR 8
+
+/* Maximum value is 65535, max pixel updates every WORLD_UPDATE_RATE_MSEC,
+ * pixels that don't fit are sent in the next update */
 #define WORLD_MAX_PIXEL_UPDATES 4096
 
+/* Chunks with at least this many pixels changed in an update are sent whole instead,
+ * up to WORLD_MAX_CHUNK_RESENDS chunks every WORLD_UPDATE_RATE_MSEC */
+#define WORLD_CHUNK_RESEND_PIXELS 128
+#define WORLD_MAX_CHUNK_RESENDS 64
+
 /***
  * Client config
  ***/
 
 #define CLIENT_MAX_WARN_LEVEL 128
+/* The warn level goes down by one this often */
+#define CLIENT_WARN_DECAY_MSEC 1000
+
+/* Players that don't move, paint or chat for this long are kicked (not admins) */
+#define CLIENT_IDLE_TIMEOUT_MSEC (20 * 60 * 1000)
+
+/* Pixel updates are only sent for chunks the client requested (and didn't unsubscribe from),
+ * when over this limit the least recently requested chunk is dropped */
+#define CLIENT_MAX_SUBSCRIBED_CHUNKS 16384
+
+/* Pixels a single PAINT, PAINT_LINE or PAINT_RECT message can change */
+#define CLIENT_MAX_BATCH_PIXELS 1024
 
 /* (rate, per n seconds) */
 #define CLIENT_PIXEL_UPD_RATELIMIT std::numeric_limits<double>::infinity();, std::numeric_limits<double>::infinity();
 #define CLIENT_CHAT_RATELIMIT 34, 44
+
+/***
+ * Server config
+ ***/
+
+/* Threads reading chunks from disk, so cold regions don't block the loop */
+#define SERVER_DISK_THREADS 2
+
+/* Event loops running worlds, including the main one. Each world runs on one of them
+ * (by name hash) and its players' sockets are moved there when they join. */
+#define SERVER_LOOP_THREADS 1
+
+/* Resolution of the client timers, see TimerWheel */
+#define SERVER_TIMER_TICK_MSEC 100
+
+/* Tasks queued from other threads (TaskBuffer): callables up to this many bytes
+ * are stored in the pooled task node, and at most N tasks run per loop iteration */
+#define SERVER_TASK_INLINE_SIZE 48
+#define SERVER_TASKS_PER_DRAIN 1024
+
+/* HTTP requests (proxy checks) running at once to the same host, the others wait */
+#define SERVER_HTTP_MAX_PER_HOST 4
+
+/* Proxy check (getipintel.net wants a contact email, it can't be enabled without one),
+ * IPs scoring at least the threshold are kicked. Failed lookups let the client in. */
+#define SERVER_PROXYCHECK_URL "http://check.getipintel.net/check.php"
+#define SERVER_PROXYCHECK_CONTACT ""
+#define SERVER_PROXYCHECK_THRESHOLD 0.95
+
+/* reCAPTCHA tokens sent by the client are checked here, captchas can't be enabled without the secret */
+#define SERVER_CAPTCHA_VERIFY_URL "https://www.google.com/recaptcha/api/siteverify"
+#define SERVER_CAPTCHA_SECRET ""
+
+/* Proxy check and captcha results are remembered per IP (in seconds), saved to reputation.bin */
+#define SERVER_REPUTATION_MAX_ENTRIES 65536
+#define SERVER_REPUTATION_PROXY_TTL (3 * 24 * 3600)
+#define SERVER_REPUTATION_CAPTCHA_TTL (24 * 3600)
+
+/* New connections allowed per IP and per subnet (/24, /64): 'rate' every 'per' seconds.
+ * The global limit is a backstop against floods from many subnets at once. Buckets of
+ * idle IPs are dropped, at most MAX_ENTRIES of each are kept. */
+#define SERVER_CONNLIMIT_IP_RATE 4
+#define SERVER_CONNLIMIT_IP_PER 5
+#define SERVER_CONNLIMIT_SUBNET_RATE 16
+#define SERVER_CONNLIMIT_SUBNET_PER 5
+#define SERVER_CONNLIMIT_GLOBAL_RATE 100
+#define SERVER_CONNLIMIT_GLOBAL_PER 5
+#define SERVER_CONNLIMIT_MAX_ENTRIES 65536
+#define SERVER_CONNLIMIT_WHEEL_SLOTS 64
+
+/* Region files open at once (for all worlds) are limited to 1/N of ulimit -n,
+ * the least recently used ones get closed */
+#define SERVER_REGION_FD_DIVISOR 4
+#define SERVER_MIN_REGION_FDS 16
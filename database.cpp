@@ -1,15 +1,21 @@
 #include "server.hpp"
 
+#include <algorithm>
+#include <dirent.h>
+
 inline bool file_exists(const std::string& name) {
     return ( access( name.c_str(), F_OK ) != -1 );
 }
 
 /* Database class functions */
 
-Database::Database(const std::string& dir)
+Database::Database(const std::string& dir, RegionCache * const regions)
 	: dir(dir),
 	  created_dir(file_exists(dir)),
-	  changedPropsOrProtects(false) {
+	  regions(regions),
+	  changedPropsOrProtects(false),
+	  writefailed(false),
+	  writes(0) {
 		if (created_dir) {
 			std::string prop;
 			std::ifstream file(dir + "props.txt");
@@ -45,15 +51,13 @@ Database::Database(const std::string& dir)
 				}
 			}
 			file.close();
+			recover();
 		}
 }
 
 Database::~Database() {
-	for(const auto& hdl : handles){
-		delete hdl.second;
-	}
-	handles.clear();
 	save();
+	checkpoint();
 }
 
 void Database::save() {
@@ -138,14 +142,20 @@ void Database::setProp(std::string key, std::string value) {
 	changedPropsOrProtects = true;
 }
 
-std::fstream * Database::get_handle(const int32_t x, const int32_t y, const bool create) {
-	if(!created_dir && create){
+bool Database::make_dir() {
+	if(!created_dir){
 		created_dir = (mkdir(dir.c_str(), 0700) == 0);
 		if(!created_dir){
 			std::cerr << "Could not create directory! (" << strerror(errno) << ")" << std::endl;
-			return nullptr;
 		}
 	}
+	return created_dir;
+}
+
+std::shared_ptr<RegionFile> Database::get_handle(const int32_t x, const int32_t y, const bool create) {
+	if(create && !make_dir()){
+		return nullptr;
+	}
 	const int32_t rx = x >> 5;
 	const int32_t ry = y >> 5;
 	const std::string mkey(key(rx, ry));
@@ -155,97 +165,245 @@ std::fstream * Database::get_handle(const int32_t x, const int32_t y, const bool
 	} else if(create){
 		nonexistant.erase(mkey);
 	}
-	const auto search = handles.find(mkey);
-	std::fstream * handle = nullptr;
-	if(search == handles.end()){
-		const std::string path(dir + "r." + std::to_string(rx) + "." + std::to_string(ry) + ".pxr");
-		if(file_exists(path)){
-			handle = new std::fstream(path, std::fstream::in | std::fstream::out | std::fstream::binary);
-			/* std::cout << "Read file: '" << path << "'" << std::endl; */
-		} else if(create){
-			handle = new std::fstream(path, std::fstream::in | std::fstream::out | std::fstream::binary | std::fstream::trunc);
-			if(handle && handle->good()){
-				uint8_t zero[3072]; /* There must be a better way of doing this */
-				memset(&zero, 0, sizeof(zero));
-				handle->write((char *)&zero, sizeof(zero));
-				/* std::cout << "Made file: '" << path << "'" << std::endl; */
-			}
-		} else {
+	const std::string path(dir + "r." + std::to_string(rx) + "." + std::to_string(ry) + ".pxr");
+	std::shared_ptr<RegionFile> handle(regions->get(path, create));
+	if(!handle){
+		if(!create && errno == ENOENT){
 			/* We tried reading, didn't find the file, don't try to read it again. */
 			if(nonexistant.size() >= 512){
 				nonexistant.clear();
 			}
 			nonexistant.emplace(mkey);
-		}
-		if(handle && handle->good()){
-			if(handles.size() > WORLD_MAX_FILE_HANDLES){
-				auto it = handles.begin();
-				/* ugly, get first element inserted */
-				for(auto it2 = handles.begin(); ++it2 != handles.end(); ++it);
-				/* look at the inline key func for explanation */
-				/*std::cout << "Closed file handle to: '" << dir << "r."
-					<< *((int32_t *)it->first.c_str()) << "."
-					<< *((int32_t *)(it->first.c_str() + sizeof(int32_t))) << ".pxr'" << std::endl;*/
-				delete it->second;
-				handles.erase(it);
-			}
-			handles[mkey] = handle;
-		} else if(handle) {
+		} else {
 			std::cerr << "Could not create/read file in '" << path << "'! (" << strerror(errno) << ")" << std::endl;
-			delete handle;
-			handle = nullptr;
-		}
-	} else {
-		handle = search->second;
-		if(handle && !handle->good()){
-			std::cerr << "A file handle has gone bad: '" << dir << "/r." << rx << "." << ry << ".pxr'" << std::endl;
-			delete handle;
-			handles.erase(search);
-			/* oh boy, not sure if this will fix anything */
-			handle = get_handle(x, y, create);
 		}
 	}
 	return handle;
 }
 
 bool Database::get_chunk(const int32_t x, const int32_t y, char * const arr) {
-	std::fstream * const file = get_handle(x, y, false);
-	if(!file || !file->good()){
+	std::lock_guard<std::mutex> lck(regionlock);
+	const std::shared_ptr<RegionFile> file(get_handle(x, y, false));
+	return file && file->read_chunk(x, y, arr);
+}
+
+bool Database::set_chunk(const int32_t x, const int32_t y, const char * const arr) {
+	std::lock_guard<std::mutex> lck(regionlock);
+	const std::shared_ptr<RegionFile> file(get_handle(x, y, true));
+	if(!file || !file->write_chunk(x, y, arr)){
+		std::cerr << "Could not save chunk X: " << x << ",  Y: " << y << std::endl;
+		writefailed = true;
 		return false;
 	}
-	file->seekg(0, std::fstream::end);
-	const size_t size = file->tellg();
-	const uint32_t lookup = 3 * ((x & 31) + (y & 31) * 32);
-	file->seekg(lookup);
-	uint32_t chunkpos = 0;
-	file->read(((char *)&chunkpos) + 1, 3);
-	if(chunkpos == 0 || size < 3072 || size - chunkpos < 768){
+	unsynced.emplace(file);
+	return true;
+}
+
+bool Database::write_snapshot(snapshot_t& snap) {
+	std::sort(snap.entries.begin(), snap.entries.end(), [](const snapshot_t::entry_t& a, const snapshot_t::entry_t& b) {
+		return key64(a.x >> 5, a.y >> 5) < key64(b.x >> 5, b.y >> 5)
+			|| (key64(a.x >> 5, a.y >> 5) == key64(b.x >> 5, b.y >> 5) && key64(a.x, a.y) < key64(b.x, b.y));
+	});
+	bool ok = true;
+	std::set<std::shared_ptr<RegionFile>> files;
+	/* One region at a time, readers only wait for the chunks of one file */
+	for(size_t i = 0; i < snap.entries.size();){
+		const uint64_t region = key64(snap.entries[i].x >> 5, snap.entries[i].y >> 5);
+		std::lock_guard<std::mutex> lck(regionlock);
+		const std::shared_ptr<RegionFile> file(get_handle(snap.entries[i].x, snap.entries[i].y, true));
+		for(; i < snap.entries.size() && key64(snap.entries[i].x >> 5, snap.entries[i].y >> 5) == region; i++){
+			snapshot_t::entry_t & e = snap.entries[i];
+			e.saved = file && file->write_chunk(e.x, e.y, &snap.arena[e.offset]);
+			if(!e.saved){
+				std::cerr << "Could not save chunk X: " << e.x << ",  Y: " << e.y << std::endl;
+				writefailed = true;
+				ok = false;
+			}
+		}
+		if(file){
+			files.emplace(file);
+		}
+	}
+	{
+		/* Chunks saved right away since the last snapshot, their edits are in the same log files */
+		std::lock_guard<std::mutex> lck(regionlock);
+		files.insert(unsynced.begin(), unsynced.end());
+		unsynced.clear();
+	}
+	for(const auto& file : files){
+		if(!file->sync()){
+			std::cerr << "Could not flush a region file in '" << dir << "'! (" << strerror(errno) << ")" << std::endl;
+			std::lock_guard<std::mutex> lck(regionlock);
+			unsynced.emplace(file);
+			writefailed = true;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+void Database::begin_write() {
+	std::lock_guard<std::mutex> lck(writelock);
+	++writes;
+}
+
+void Database::end_write() {
+	std::lock_guard<std::mutex> lck(writelock);
+	if(--writes == 0){
+		writecv.notify_all();
+	}
+}
+
+void Database::wait_writes() {
+	std::unique_lock<std::mutex> lck(writelock);
+	writecv.wait(lck, [this] { return writes == 0; });
+}
+
+std::shared_ptr<WriteAheadLog> Database::get_log(const bool create) {
+	if(!wal && create && make_dir()){
+		wal.reset(WriteAheadLog::open(dir));
+		if(!wal){
+			std::cerr << "Could not open the edit log in '" << dir << "'! (" << strerror(errno) << ")" << std::endl;
+		}
+	}
+	return wal;
+}
+
+void Database::log_px(const int32_t x, const int32_t y, const uint8_t r, const uint8_t g, const uint8_t b) {
+	if(get_log()){
+		wal->log_px(x, y, r, g, b);
+	}
+}
+
+void Database::log_chunk(const int32_t x, const int32_t y, const char * const arr) {
+	if(get_log()){
+		wal->log_chunk(x, y, arr);
+	}
+}
+
+void Database::log_protect(const int32_t x, const int32_t y, const bool state) {
+	if(get_log()){
+		wal->log_protect(x, y, state);
+	}
+}
+
+bool Database::sync_files() {
+	bool synced = true;
+	std::lock_guard<std::mutex> lck(regionlock);
+	for(auto it = unsynced.begin(); it != unsynced.end();){
+		if((*it)->sync()){
+			it = unsynced.erase(it);
+		} else {
+			std::cerr << "Could not flush a region file in '" << dir << "'! (" << strerror(errno) << ")" << std::endl;
+			synced = false;
+			++it;
+		}
+	}
+	return synced;
+}
+
+bool Database::checkpoint() {
+	const bool synced = sync_files() && !writefailed;
+	if(!synced){
+		/* The log is the only copy of some edits, keep it for the next start */
 		return false;
-	} 
-	file->seekg(chunkpos);
-	file->read(arr, 768);
+	}
+	if(wal && !wal->checkpoint()){
+		std::cerr << "Could not empty the edit log in '" << dir << "'! (" << strerror(errno) << ")" << std::endl;
+		return false;
+	}
 	return true;
 }
 
-void Database::set_chunk(const int32_t x, const int32_t y, const char * const arr) {
-	std::fstream * const file = get_handle(x, y, true);
-	if(!file || !file->good()){
-		std::cerr << "Could not save chunk X: " << x << ",  Y: " << y << std::endl;
+bool Database::compact(const uint32_t bgclr, uint64_t& reclaimed, uint32_t& dropped) {
+	std::vector<std::string> names;
+	DIR * const d = opendir(dir.c_str());
+	if(!d){
+		return errno == ENOENT;
+	}
+	while(const dirent * const e = readdir(d)){
+		const std::string name(e->d_name);
+		if(name.size() > 6 && name.compare(0, 2, "r.") == 0 && name.compare(name.size() - 4, 4, ".pxr") == 0){
+			names.push_back(name);
+		}
+	}
+	closedir(d);
+	bool ok = true;
+	for(const std::string& name : names){
+		const std::string path(dir + name);
+		/* One file at a time, like write_snapshot */
+		std::lock_guard<std::mutex> lck(regionlock);
+		const std::shared_ptr<RegionFile> file(regions->get(path, false));
+		uint32_t filedropped = 0;
+		if(!file){
+			continue;
+		}
+		const size_t before = file->get_size();
+		if(!file->compact(bgclr, filedropped)){
+			std::cerr << "Could not compact '" << path << "'! (" << strerror(errno) << ")" << std::endl;
+			ok = false;
+			continue;
+		}
+		dropped += filedropped;
+		if(file->is_empty() && unlink(path.c_str()) == 0){
+			/* Chunks missing from the disk are empty, the file isn't needed */
+			regions->drop(path);
+			unsynced.erase(file);
+			reclaimed += before;
+		} else if(before > file->get_size()){
+			reclaimed += before - file->get_size();
+		}
+	}
+	return ok;
+}
+
+bool Database::has_failed() const {
+	return writefailed;
+}
+
+/* Applies the edits logged before a crash to the region files */
+void Database::recover() {
+	uint32_t bgclr = 0xFFFFFF;
+	try {
+		bgclr = stoul(getProp("bgcolor", "FFFFFF"), nullptr, 16);
+	} catch(std::invalid_argument) {
+	} catch(std::out_of_range) { }
+	bgclr = (bgclr & 0xFF) << 16 | (bgclr & 0xFF00) | (bgclr & 0xFF0000) >> 16;
+	std::unordered_map<uint64_t, std::vector<char>> touched;
+	const auto chunk_at = [this, bgclr, &touched](const int32_t x, const int32_t y) -> char * {
+		std::vector<char> & data = touched[key64(x, y)];
+		if(data.empty()){
+			data.resize(16 * 16 * 3);
+			if(!get_chunk(x, y, data.data())){
+				for(size_t i = 0; i < data.size(); i++){
+					data[i] = (char) (bgclr >> ((i % 3) * 8));
+				}
+			}
+		}
+		return data.data();
+	};
+	const size_t records = WriteAheadLog::replay(dir,
+	[this, &chunk_at](const uint8_t type, const int32_t x, const int32_t y, const uint8_t * const data) {
+		switch(type){
+			case WriteAheadLog::PIXEL:
+				memcpy(chunk_at(x >> 4, y >> 4) + ((y & 0xF) * 16 + (x & 0xF)) * 3, data, 3);
+				break;
+			case WriteAheadLog::CHUNK:
+				memcpy(chunk_at(x, y), data, 16 * 16 * 3);
+				break;
+			case WriteAheadLog::PROTECT:
+				setChunkProtection(x, y, data[0]);
+				break;
+		}
+	});
+	if(!records){
 		return;
 	}
-	file->seekg(0, std::fstream::end);
-	const size_t size = file->tellg();
-	const uint32_t lookup = 3 * ((x & 31) + (y & 31) * 32);
-	file->seekg(lookup);
-	uint32_t chunkpos = 0;
-	file->read(((char *)&chunkpos) + 1, 3);
-	/* TODO: check for corruption */
-	if(chunkpos == 0){
-		file->seekp(lookup);
-		file->write(((char *)&size) + 1, 3);
-		chunkpos = size;
-	}
-	file->seekp(chunkpos);
-	file->write(arr, 768);
-	file->flush();
+	for(const auto& chunk : touched){
+		set_chunk((int32_t)(uint32_t)chunk.first, (int32_t)(chunk.first >> 32), chunk.second.data());
+	}
+	save();
+	if(get_log() && checkpoint()){
+		std::cout << "Recovered " << records << " edits from the log in '" << dir << "'" << std::endl;
+	}
 }
@@ -1,43 +1,167 @@
 #include "limiter.hpp"
 
+static thread_local uv_loop_t * clockloop = nullptr;
+
+uint64_t limiter::now() {
+	if (clockloop != nullptr) {
+		return uv_now(clockloop);
+	}
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void limiter::use_loop(uv_loop_t * const loop) {
+	clockloop = loop;
+}
+
+static inline uint64_t full(const uint16_t rate, const uint16_t per) {
+	return (uint64_t)rate * per * 1000;
+}
+
+/* Adds the time passed since the last check, up to a full bucket */
+static inline void refill(uint64_t& allowance, uint64_t& last_check, const uint16_t rate, const uint16_t per, const uint64_t t) {
+	if (t > last_check) {
+		const uint64_t passed = t - last_check;
+		const uint64_t max = full(rate, per);
+		/* Capped before multiplying, a full refill takes 'per' seconds */
+		allowance += (passed < (uint64_t)per * 1000 ? passed : (uint64_t)per * 1000) * rate;
+		if (allowance > max) {
+			allowance = max;
+		}
+		last_check = t;
+	}
+}
+
+static inline bool spend(uint64_t& allowance, const uint16_t per, const uint32_t count) {
+	const uint64_t cost = (uint64_t)count * per * 1000;
+	if (allowance < cost) {
+		return false;
+	}
+	allowance -= cost;
+	return true;
+}
+
+/* Full on its first use, even if set() raised the rate before that */
 limiter::Bucket::Bucket(const uint16_t rate, const uint16_t per)
 	: rate(rate),
-	  per(per),
-	  allowance(rate) { }
+	  per(per < 1 ? 1 : per),
+	  allowance(full(rate, this->per)),
+	  last_check(0) { }
 
 void limiter::Bucket::set(uint16_t nrate, uint16_t nper) {
+	nper = nper < 1 ? 1 : nper;
+	/* The same amount of tokens, in the new units */
+	allowance = allowance / per * nper;
 	rate = nrate;
-	per = nper < 1 ? 1 : nper;
-	if (allowance > nrate) {
-		allowance = nrate;
+	per = nper;
+	if (allowance > full(rate, per)) {
+		allowance = full(rate, per);
 	}
 }
 
-bool limiter::Bucket::can_spend(const uint16_t count) {
-	const auto now = std::chrono::steady_clock::now();
-	std::chrono::duration<float> passed = now - last_check;
-	last_check = now;
-	allowance += passed.count() * ((float)rate / per);
-	if(allowance > rate){
-		allowance = rate;
+bool limiter::Bucket::can_spend(const uint32_t count) {
+	refill(allowance, last_check, rate, per, now());
+	return spend(allowance, per, count);
+}
+
+uint32_t limiter::Bucket::spend_up_to(const uint32_t count) {
+	refill(allowance, last_check, rate, per, now());
+	const uint64_t available = allowance / ((uint64_t)per * 1000);
+	const uint32_t spent = available < count ? (uint32_t)available : count;
+	allowance -= (uint64_t)spent * per * 1000;
+	return spent;
+}
+
+limiter::Table::Table(const uint16_t rate, const uint16_t per, const size_t limit, const size_t slots)
+	: rate(rate),
+	  per(per < 1 ? 1 : per),
+	  limit(limit),
+	  wheel(slots < 2 ? 2 : slots),
+	  current(0),
+	  current_time(now()),
+	  tracked(0) { }
+
+void limiter::Table::set(uint16_t nrate, uint16_t nper) {
+	nper = nper < 1 ? 1 : nper;
+	for (auto& e : entries) {
+		e.second.allowance = e.second.allowance / per * nper;
+		if (e.second.allowance > full(nrate, nper)) {
+			e.second.allowance = full(nrate, nper);
+		}
 	}
-	if(allowance < count){
-		return false;
+	rate = nrate;
+	per = nper;
+}
+
+/* Puts the key in the slot where it will have refilled, or in the last one if that's further */
+void limiter::Table::schedule(const std::string& key, const uint64_t idle) {
+	const uint64_t left = (uint64_t)per * 1000 - idle;
+	size_t slots = left / 1000 + 1;
+	if (slots >= wheel.size()) {
+		slots = wheel.size() - 1;
 	}
-	allowance -= count;
-	return true;
+	wheel[(current + slots) % wheel.size()].push_back(key);
 }
 
+void limiter::Table::advance(const uint64_t t) {
+	if (t <= current_time) {
+		return;
+	}
+	const uint64_t ticks = (t - current_time) / 1000;
+	/* Past a full turn, every slot gets checked once */
+	const size_t turns = ticks < wheel.size() ? ticks : wheel.size();
+	current_time += ticks * 1000;
+	for (size_t i = 0; i < turns; i++) {
+		current = (current + 1) % wheel.size();
+		std::vector<std::string> due;
+		due.swap(wheel[current]);
+		for (auto& key : due) {
+			const auto search = entries.find(key);
+			if (search == entries.end()) {
+				continue;
+			}
+			/* Keys aren't moved when used, so some are still active */
+			const uint64_t idle = t > search->second.last_check ? t - search->second.last_check : 0;
+			if (idle >= (uint64_t)per * 1000) {
+				entries.erase(search);
+				--tracked;
+			} else {
+				schedule(key, idle);
+			}
+		}
+	}
+}
+
+bool limiter::Table::can_spend(const std::string& key, const uint32_t count) {
+	const uint64_t t = now();
+	advance(t);
+	auto search = entries.find(key);
+	if (search == entries.end()) {
+		if (entries.size() >= limit) {
+			return true;
+		}
+		search = entries.emplace(key, entry_t{full(rate, per), t}).first;
+		schedule(key, 0);
+		++tracked;
+	}
+	entry_t& e = search->second;
+	refill(e.allowance, e.last_check, rate, per, t);
+	return spend(e.allowance, per, count);
+}
+
+size_t limiter::Table::size() const {
+	return tracked;
+}
 
 limiter::Simple::Simple(const float rate)
-	: rate(rate) { }
+	: interval(rate * 1000),
+	  last_check(0) { }
 
 bool limiter::Simple::can_spend() {
-	const auto now = std::chrono::steady_clock::now();
-	std::chrono::duration<float> passed = now - last_check;
-	if(passed.count() < rate){
+	const uint64_t t = now();
+	if (t - last_check < interval) {
 		return false;
 	}
-	last_check = now;
+	last_check = t;
 	return true;
 }
@@ -1,20 +1,66 @@
 #include <chrono>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <uv.h>
 
 namespace limiter {
+	/* Milliseconds. On threads running a loop (see use_loop) this is the loop's time,
+	 * updated once per iteration, elsewhere it's read from steady_clock. Both count
+	 * from the same point, so buckets can be used from either. */
+	uint64_t now();
+	void use_loop(uv_loop_t * const);
+
+	/* Allowance is kept in 1/(per * 1000) tokens, so a millisecond refills exactly
+	 * 'rate' units and nothing is lost to rounding */
 	class Bucket {
 		uint16_t rate;
 		uint16_t per;
-		float allowance;
-		std::chrono::steady_clock::time_point last_check;
+		uint64_t allowance;
+		uint64_t last_check;
 	public:
 		Bucket(const uint16_t rate, const uint16_t per);
 		void set(uint16_t rate, uint16_t per);
-		bool can_spend(const uint16_t = 1);
+		bool can_spend(const uint32_t = 1);
+		/* Spends as much of 'count' as there is, returns how much */
+		uint32_t spend_up_to(const uint32_t count);
 	};
-	
+
+	/* Buckets by key (IP, subnet...), made on first use. A bucket left alone until it
+	 * refilled is the same as a new one, so it's dropped: a wheel of one second slots
+	 * finds those without scanning. At most 'limit' keys, after that new keys aren't
+	 * limited (the caller should have a global bucket too). Not thread safe, except size(). */
+	class Table {
+		struct entry_t {
+			uint64_t allowance;
+			uint64_t last_check;
+		};
+
+		uint16_t rate;
+		uint16_t per;
+		const size_t limit;
+		std::unordered_map<std::string, entry_t> entries;
+		std::vector<std::vector<std::string>> wheel; /* Keys to check in each slot */
+		size_t current;
+		uint64_t current_time;
+		std::atomic<size_t> tracked; /* Of entries, for other threads */
+
+	public:
+		Table(const uint16_t rate, const uint16_t per, const size_t limit, const size_t slots);
+		void set(uint16_t rate, uint16_t per);
+		bool can_spend(const std::string& key, const uint32_t = 1);
+		size_t size() const; /* Thread safe */
+
+	private:
+		void advance(const uint64_t now);
+		void schedule(const std::string& key, const uint64_t idle);
+	};
+
 	class Simple {
-		float rate;
-		std::chrono::steady_clock::time_point last_check;
+		uint64_t interval;
+		uint64_t last_check;
 	public:
 		Simple(const float rate);
 		bool can_spend();
@@ -16,7 +16,9 @@ std::string gen_random_str(const size_t size) {
 	return str;
 }
 
-void handler(int s) {
+/* Runs on the main loop, other loops can't wake it up from a signal handler */
+void handler(uv_signal_t * const hdl, int s) {
+	uv_signal_stop(hdl);
 	std::cout << "Saving worlds and exiting..." << std::endl;
 	srvptr->quit();
 }
@@ -29,12 +31,13 @@ int main(int argc, char * argv[]) {
             argc > 4 ? argv[4] : gen_random_str(10),
 						argc > 5 ? argv[5] : "chunkdata");
 	
-	struct sigaction sigIntHandler;
-	sigIntHandler.sa_handler = handler;
-	sigemptyset(&sigIntHandler.sa_mask);
-	sigIntHandler.sa_flags = 0;
-	
-	sigaction(SIGINT, &sigIntHandler, NULL);
+	uv_signal_t sigint_hdl;
+	uv_signal_init(uv_default_loop(), &sigint_hdl);
+	uv_signal_start(&sigint_hdl, (uv_signal_cb)&handler, SIGINT);
+	/* Sent by Heroku (and most service managers) before killing the process */
+	uv_signal_t sigterm_hdl;
+	uv_signal_init(uv_default_loop(), &sigterm_hdl);
+	uv_signal_start(&sigterm_hdl, (uv_signal_cb)&handler, SIGTERM);
 	
 	srvptr->run();
 	delete srvptr;
@@ -3,6 +3,10 @@
 #include "json.hpp"
 
 #include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <arpa/inet.h>
+#include <dirent.h>
 
 /* Server class functions */
 
@@ -27,6 +31,65 @@ size_t getUTF8strlen(const std::string& str) {
 	return (j);
 }
 
+/* Expands a PAINT, PAINT_LINE or PAINT_RECT message into its pixels,
+ * false if it's malformed or paints more than CLIENT_MAX_BATCH_PIXELS */
+static bool read_paint(const uint8_t op, const char * const items, const size_t len, const uint32_t count, std::vector<pixupd_t>& pxs) {
+	const size_t itemsize = op == PAINT ? sizeof(pixupd_t) : op == PAINT_LINE ? sizeof(paintline_t) : sizeof(paintrect_t);
+	if (len / itemsize != count || len % itemsize) {
+		return false;
+	}
+	for (size_t i = 0; i < len; i += itemsize) {
+		if (op == PAINT) {
+			if (pxs.size() >= CLIENT_MAX_BATCH_PIXELS) {
+				return false;
+			}
+			pixupd_t px;
+			memcpy(&px, items + i, sizeof(pixupd_t));
+			pxs.push_back(px);
+		} else if (op == PAINT_LINE) {
+			paintline_t l;
+			memcpy(&l, items + i, sizeof(paintline_t));
+			const int64_t dx = std::abs((int64_t)l.x2 - l.x1);
+			const int64_t dy = -std::abs((int64_t)l.y2 - l.y1);
+			if (std::max(dx, -dy) >= (int64_t)(CLIENT_MAX_BATCH_PIXELS - pxs.size())) {
+				return false;
+			}
+			const int32_t sx = l.x1 < l.x2 ? 1 : -1;
+			const int32_t sy = l.y1 < l.y2 ? 1 : -1;
+			int64_t err = dx + dy;
+			int32_t x = l.x1;
+			int32_t y = l.y1;
+			while (true) {
+				pxs.push_back({x, y, l.r, l.g, l.b});
+				if (x == l.x2 && y == l.y2) {
+					break;
+				}
+				const int64_t e2 = 2 * err;
+				if (e2 >= dy) {
+					err += dy;
+					x += sx;
+				}
+				if (e2 <= dx) {
+					err += dx;
+					y += sy;
+				}
+			}
+		} else {
+			paintrect_t r;
+			memcpy(&r, items + i, sizeof(paintrect_t));
+			if ((size_t)r.w * r.h > CLIENT_MAX_BATCH_PIXELS - pxs.size()) {
+				return false;
+			}
+			for (uint32_t y = 0; y < r.h; y++) {
+				for (uint32_t x = 0; x < r.w; x++) {
+					pxs.push_back({(int32_t)(r.x + x), (int32_t)(r.y + y), r.r, r.g, r.b});
+				}
+			}
+		}
+	}
+	return true;
+}
+
 Server::Server(const uint16_t port, const std::string& modpw, const std::string& adminpw, const std::string& devpw, const std::string& path)
 	: port(port),
 	  modpw(modpw),
@@ -34,21 +97,74 @@ Server::Server(const uint16_t port, const std::string& modpw, const std::string&
 	  adminpw(adminpw),
 	  path(path + "/"),
 	  cmds(this),
-	  connlimiter(10, 5),
+	  connlimiter(SERVER_CONNLIMIT_GLOBAL_RATE, SERVER_CONNLIMIT_GLOBAL_PER),
+	  iplimiter(SERVER_CONNLIMIT_IP_RATE, SERVER_CONNLIMIT_IP_PER,
+	            SERVER_CONNLIMIT_MAX_ENTRIES, SERVER_CONNLIMIT_WHEEL_SLOTS),
+	  subnetlimiter(SERVER_CONNLIMIT_SUBNET_RATE, SERVER_CONNLIMIT_SUBNET_PER,
+	            SERVER_CONNLIMIT_MAX_ENTRIES, SERVER_CONNLIMIT_WHEEL_SLOTS),
 	  h(uWS::NO_DELAY, true),
+	  diskpool(SERVER_DISK_THREADS),
+	  savepool(1),
+	  regions(RegionCache::fd_budget()),
+	  reputation(SERVER_REPUTATION_MAX_ENTRIES),
+	  connections(0),
 	  maxconns(458568),
 	  captcha_required(false),
 	  lockdown(false),
 	  proxy_lock(false),
 	  instaban(false),
 	  trusting_captcha(false),
-	  fastconnectaction(0) {
+	  fastconnectaction(0),
+	  rejected_banned(0),
+	  rejected_lockdown(0),
+	  rejected_conns(0),
+	  rejected_fast(0) {
 	std::cout << "Admin password set to: " << adminpw << "." << std::endl;
 	std::cout << "Moderator password set to: " << modpw << "." << std::endl;
   std::cout << "Developer password set to: " << devpw << "." << std::endl;
    std::cout << "Listening on port " << port << "." << std::endl;
 	readfiles();
 
+	/* Drops connections we'd reject anyway before the handshake is done for them,
+	 * onConnection checks again in case the lists changed in between */
+	h.onAccept([this](uS::Socket::Address addr) {
+		std::string ip(addr.address);
+		if (ip.compare(0, 7, "::ffff:") == 0) {
+			ip = ip.substr(7);
+		}
+		{
+			std::lock_guard<std::mutex> lck(listlock);
+			if (ipban.contains(ip)) {
+				++rejected_banned;
+				return false;
+			}
+			if (lockdown && !ipwhitelist.contains(ip)) {
+				++rejected_lockdown;
+				return false;
+			}
+			const auto search = conns.find(ip);
+			const uint32_t open = search == conns.end() ? 0 : search->second;
+			if (open >= maxconns || (open > 0 && ipblacklist.contains(ip))) {
+				++rejected_conns;
+				return false;
+			}
+		}
+		/* Captcha (3) is asked for after the upgrade, kicks and bans happen here */
+		const uint8_t action = fastconnectaction;
+		if ((action == 1 || action == 2) && !can_connect(ip)) {
+			++rejected_fast;
+			if (action == 2) {
+				{
+					std::lock_guard<std::mutex> lck(listlock);
+					ipban.add(ip);
+				}
+				admintell("DEVBanned IP: " + ip);
+			}
+			return false;
+		}
+		return true;
+	});
+
 	h.onConnection([this](uWS::WebSocket<uWS::SERVER> ws, uWS::UpgradeInfo ui) {
 		SocketInfo * si = new SocketInfo();
 		si->ip = ws.getAddress().address;
@@ -56,14 +172,22 @@ Server::Server(const uint16_t port, const std::string& modpw, const std::string&
 			si->ip = si->ip.substr(7);
 		}
 		si->player = nullptr;
-		connsws.emplace(ws);
+		si->proxywait = false;
+		si->unjoined = false;
+		++connections;
 		ws.setUserData(si);
-		bool whitelisted = ipwhitelist.find(si->ip) != ipwhitelist.end();
-		bool banned = ipban.find(si->ip) != ipban.end();
+		uint8_t solved = 0;
+		if (captcha_required) {
+			reputation.get(si->ip, IpReputation::CAPTCHA, solved);
+		}
+		std::unique_lock<std::mutex> lck(listlock);
+		bool whitelisted = ipwhitelist.contains(si->ip);
+		bool banned = ipban.contains(si->ip);
 		bool isskidbot = instaban && si->origin == "(None)";
-		bool blacklisted = ipblacklist.find(si->ip) != ipwhitelist.end();
-		si->captcha_verified = {captcha_required && !(whitelisted && trusting_captcha) ? CA_WAITING : CA_OK};
+		bool blacklisted = ipblacklist.contains(si->ip);
+		si->captcha_verified = {captcha_required && !(whitelisted && trusting_captcha) && !solved ? CA_WAITING : CA_OK};
 		if ((lockdown && !whitelisted) || (banned)) {
+			lck.unlock();
 			if (!banned) {
 				std::string m("Sorry, the server is not accepting new connections right now (lockdown).");
 				ws.send(m.c_str(), m.size(), uWS::TEXT);
@@ -75,7 +199,8 @@ Server::Server(const uint16_t port, const std::string& modpw, const std::string&
 			return;
 		}
 		if (isskidbot && !banned) {
-			ipban.emplace(si->ip);
+			ipban.add(si->ip);
+			lck.unlock();
 			admintell("DEVBanned IP: " + si->ip);
 			banned = true;
 			ws.close();
@@ -85,30 +210,36 @@ Server::Server(const uint16_t port, const std::string& modpw, const std::string&
 		if (search == conns.end()) {
 			conns[si->ip] = 1;
 		} else if (++search->second > maxconns || blacklisted) {
-			std::string m("Sorry, but you have reached the maximum number of simultaneous connections, (" + std::to_string(blacklisted ? 1 : maxconns) + ").");
+			lck.unlock();
+			std::string m("Sorry, but you have reached the maximum number of simultaneous connections, (" + std::to_string(blacklisted ? 1 : maxconns.load()) + ").");
 			ws.send(m.c_str(), m.size(), uWS::TEXT);
 			ws.close();
 			return;
 		}
-		if (!connlimiter.can_spend()) {
-			switch (fastconnectaction) {
-				case 3:
-					si->captcha_verified = CA_WAITING;
-					break;
-				case 2:
-					ipban.emplace(si->ip);
-					admintell("DEVBanned IP: " + si->ip);
-				case 1:
-					ws.close();
-					break;
+		lck.unlock();
+		if (fastconnectaction == 3 && !can_connect(si->ip)) {
+			si->captcha_verified = CA_WAITING;
+		}
+
+		if (proxy_lock && !whitelisted) {
+			uint8_t isproxy;
+			if (!reputation.get(si->ip, IpReputation::PROXY_CHECK, isproxy)) {
+				si->proxywait = true;
+				check_proxy(si->ip);
+			} else if (isproxy) {
+				std::string m("Sorry, proxies and VPNs are not allowed.");
+				ws.send(m.c_str(), m.size(), uWS::TEXT);
+				ws.close();
+				return;
 			}
 		}
 
-		uint8_t captcha_request[2] = {CAPTCHA_REQUIRED, si->captcha_verified};
+		unjoined_add(ws);
+		uint8_t captcha_request[2] = {CAPTCHA_REQUIRED, si->proxywait ? (uint8_t)CA_VERIFYING : si->captcha_verified.load()};
 		ws.send((const char *)&captcha_request[0], sizeof(captcha_request), uWS::BINARY);
 	});
 
-	h.onMessage([this, adminpw](uWS::WebSocket<uWS::SERVER> ws, const char * msg, size_t len, uWS::OpCode oc) {
+	msghandler = [this](uWS::WebSocket<uWS::SERVER> ws, const char * msg, size_t len, uWS::OpCode oc) {
 		SocketInfo * const si = ((SocketInfo *)ws.getUserData());
 		Client * const player = si->player;
 		if(player && oc == uWS::BINARY){
@@ -166,6 +297,44 @@ Server::Server(const uint16_t port, const std::string& modpw, const std::string&
 					ws.close();
 				} break;
 			};
+
+				default: {
+					if(len < sizeof(exthdr_t)){
+						break;
+					}
+					exthdr_t hdr;
+					memcpy(&hdr, msg, sizeof(exthdr_t));
+					const char * const items = msg + sizeof(exthdr_t);
+					const size_t itemslen = len - sizeof(exthdr_t);
+					switch(hdr.op){
+						case UNSUBSCRIBE: {
+							if(itemslen / sizeof(chunkpos_t) != hdr.count || itemslen % sizeof(chunkpos_t)){
+								player->warn();
+								break;
+							}
+							for(size_t i = 0; i < itemslen; i += sizeof(chunkpos_t)){
+								chunkpos_t pos;
+								memcpy(&pos, items + i, sizeof(chunkpos_t));
+								player->unsubscribe(pos.x, pos.y);
+							}
+						} break;
+
+						case PAINT:
+						case PAINT_LINE:
+						case PAINT_RECT: {
+							std::vector<pixupd_t> pxs;
+							if(!read_paint(hdr.op, items, itemslen, hdr.count, pxs)){
+								player->warn();
+								break;
+							}
+							player->put_pxs(pxs);
+						} break;
+
+						default:
+							player->warn();
+							break;
+					}
+				} break;
 			};
 		} else if(player && oc == uWS::TEXT && len > 1 && msg[len-1] == '\12'){
 			std::string mstr(msg, len - 1);
@@ -179,14 +348,18 @@ Server::Server(const uint16_t port, const std::string& modpw, const std::string&
 			} else {
 				player->warn();
 			}
-		} else if(!player && si->captcha_verified == CA_OK && oc == uWS::BINARY && len > 2 && len - 2 <= 24){
-			join_world(ws, std::string(msg, len - 2));
+		} else if(!player && !si->proxywait && si->captcha_verified == CA_WAITING && oc == uWS::TEXT && len > 7 && memcmp(msg, "CaptchA", 7) == 0){
+			verify_captcha(ws, std::string(msg + 7, len - 7));
+		} else if(!player && !si->proxywait && si->captcha_verified == CA_OK && oc == uWS::BINARY && len > 2 && len - 2 <= 24){
+			uint16_t protocol;
+			memcpy(&protocol, &msg[len - 2], sizeof(uint16_t));
+			join_world(ws, std::string(msg, len - 2), protocol);
 		} else if(!player){
 			ws.close();
 		}
-	});
+	};
 
-	h.onDisconnection([this](uWS::WebSocket<uWS::SERVER> ws, int c, const char * msg, size_t len) {
+	dischandler = [this](uWS::WebSocket<uWS::SERVER> ws, int c, const char * msg, size_t len) {
 		bool lock_check = false;
 		SocketInfo * const si = (SocketInfo *)ws.getUserData();
 		if(si->player){
@@ -196,44 +369,67 @@ Server::Server(const uint16_t port, const std::string& modpw, const std::string&
 			}
 			si->player->safedelete(false);
 			if(w && w->is_empty()){
-				worlds.erase(w->name);
+				{
+					std::lock_guard<std::mutex> lck(worldlock);
+					worlds.erase(w->name);
+				}
 				w->safedelete();
 			}
+		} else if(si->unjoined){
+			unjoined_rm(ws);
 		}
-		auto search = conns.find(si->ip);
-		if (search != conns.end()) {
-			if (--search->second == 0) {
-				conns.erase(search);
+		{
+			std::lock_guard<std::mutex> lck(listlock);
+			auto search = conns.find(si->ip);
+			if (search != conns.end()) {
+				if (--search->second == 0) {
+					conns.erase(search);
+				}
 			}
 		}
-		connsws.erase(ws);
+		--connections;
 		delete si;
 		if (lock_check) {
 			lockdown_check();
 		}
-	});
+	};
+
+	h.onMessage(msghandler);
+	h.onDisconnection(dischandler);
+	for (uint32_t i = 0; i < (SERVER_LOOP_THREADS ? SERVER_LOOP_THREADS : 1); i++) {
+		shards.push_back(new Shard(this, i));
+	}
 }
 
 Server::~Server() {
-	for (auto it = connsws.begin(); it != connsws.end();) {
-		auto client = *it++;
-		client.close();
+	h.getDefaultGroup<uWS::SERVER>().forEach([](uWS::WebSocket<uWS::SERVER> ws) {
+		ws.close();
+	});
+	/* No chunk reads can be running while the worlds get deleted */
+	diskpool.stop();
+	for (size_t i = shards.size(); --i > 0;) {
+		shards[i]->stop();
+		delete shards[i];
 	}
 	for(const auto& world : worlds){
 		delete world.second;
 	}
+	delete shards[0];
 	writefiles();
 }
 
 void Server::broadcastmsg(const std::string& msg) {
-	h.getDefaultGroup<uWS::SERVER>().broadcast(msg.c_str(), msg.size(), uWS::TEXT);
+	on_shards([msg](Shard * const shard) {
+		shard->get_group()->broadcast(msg.c_str(), msg.size(), uWS::TEXT);
+	});
 }
 
 void Server::run() {
 	mkdir(path.c_str(), 0700);
+	recover_worlds();
 	uv_timer_init(uv_default_loop(), &save_hdl);
 	save_hdl.data = this;
-	uv_timer_start(&save_hdl, (uv_timer_cb)&save_chunks, 900000, 900000);
+	uv_timer_start(&save_hdl, (uv_timer_cb)&save_files, 900000, 900000);
 	h.listen(port);
 	h.run();
 }
@@ -253,20 +449,48 @@ void Server::quit() {
 }
 
 void Server::save_now() {
-	for(const auto& world : worlds){
-		world.second->save();
-	}
+	on_shards([this](Shard * const shard) {
+		/* Only this thread removes the shard's worlds, they can be saved unlocked */
+		std::vector<World *> owned;
+		{
+			std::lock_guard<std::mutex> lck(worldlock);
+			for(const auto& world : worlds){
+				if(world.second->shard == shard){
+					owned.push_back(world.second);
+				}
+			}
+		}
+		for(World * const w : owned){
+			w->snapshot();
+		}
+	});
 	writefiles();
-	std::cout << "Worlds saved." << std::endl;
-	admintell("DEVWorlds saved.");
+	std::cout << "Saving worlds..." << std::endl;
+	admintell("DEVSaving worlds...");
+}
+
+void Server::recover_worlds() {
+	DIR * const d = opendir(path.c_str());
+	if(!d){
+		return;
+	}
+	while(const dirent * const e = readdir(d)){
+		const std::string name(e->d_name);
+		if(name == "." || name == ".." || !WriteAheadLog::has_records(path + name + "/")){
+			continue;
+		}
+		/* Replays the log when opened */
+		Database db(path + name + "/", &regions);
+	}
+	closedir(d);
 }
 
-void Server::save_chunks(uv_timer_t * const t) {
-	Server * const srv = (Server *)t->data;
-	srv->save_now();
+void Server::save_files(uv_timer_t * const t) {
+	/* Worlds save their chunks by themselves, see World::checkpoint */
+	((Server *)t->data)->writefiles();
 }
 
-void Server::join_world(uWS::WebSocket<uWS::SERVER> ws, const std::string& worldname) {
+void Server::join_world(uWS::WebSocket<uWS::SERVER> ws, const std::string& worldname, const uint16_t protocol) {
 	/* Validate world name, allowed chars are a..z, 0..9, '_' and '.' */
 	for(size_t i = worldname.size(); i--;){
 		if(!((worldname[i] > 96 && worldname[i] < 123) ||
@@ -276,20 +500,98 @@ void Server::join_world(uWS::WebSocket<uWS::SERVER> ws, const std::string& world
 			return;
 		}
 	}
-	const auto search = worlds.find(worldname);
+	SocketInfo * si = (SocketInfo *)ws.getUserData();
+	if(si->unjoined){
+		unjoined_rm(ws);
+	}
+	Shard * const shard = get_shard(worldname);
+	if(!shard->is_current()){
+		/* Joins once the socket is on the world's loop, see Shard::adopted */
+		si->joinworld = worldname;
+		si->joinprotocol = protocol;
+		shard->adopt(ws);
+		return;
+	}
 	World * w = nullptr;
-	if(search == worlds.end()){
-		worlds[worldname] = w = new World(path, worldname);
-	} else {
-		w = search->second;
+	{
+		std::lock_guard<std::mutex> lck(worldlock);
+		const auto search = worlds.find(worldname);
+		if(search != worlds.end()){
+			w = search->second;
+		}
+	}
+	if(!w){
+		/* Nobody else adds this world, the lock isn't held while it loads its properties */
+		w = new World(path, worldname, shard, &diskpool, &savepool, &regions);
+		std::lock_guard<std::mutex> lck(worldlock);
+		worlds[worldname] = w;
 	}
 	if(w){
-		SocketInfo * si = (SocketInfo *)ws.getUserData();
-		Client * const cl = si->player = new Client(w->get_id(), ws, w, si);
+		Client * const cl = si->player = new Client(w->get_id(), ws, w, si, protocol);
 		w->add_cli(cl);
 	}
 }
 
+Shard * Server::get_shard(const std::string& worldname) const {
+	return shards[std::hash<std::string>()(worldname) % shards.size()];
+}
+
+void Server::on_shards(const std::function<void(Shard * const)>& fn) {
+	for (Shard * const shard : shards) {
+		shard->exec([fn, shard] {
+			fn(shard);
+		});
+	}
+}
+
+void Server::for_each_socket(const std::function<void(uWS::WebSocket<uWS::SERVER>)>& fn) {
+	on_shards([fn](Shard * const shard) {
+		shard->get_group()->forEach(fn);
+	});
+}
+
+void Server::on_worlds(const std::function<void(World * const)>& fn) {
+	on_shards([this, fn](Shard * const shard) {
+		/* Only this shard adds or removes its worlds, they stay while we're on it */
+		std::vector<World *> owned;
+		{
+			std::lock_guard<std::mutex> lck(worldlock);
+			for (const auto& w : worlds) {
+				if (w.second->shard == shard) {
+					owned.push_back(w.second);
+				}
+			}
+		}
+		for (World * const w : owned) {
+			fn(w);
+		}
+	});
+}
+
+void Server::unjoined_add(uWS::WebSocket<uWS::SERVER> ws) {
+	SocketInfo * const si = (SocketInfo *)ws.getUserData();
+	unjoined[si->ip].push_back(ws);
+	si->unjoined = true;
+}
+
+void Server::unjoined_rm(uWS::WebSocket<uWS::SERVER> ws) {
+	SocketInfo * const si = (SocketInfo *)ws.getUserData();
+	const auto search = unjoined.find(si->ip);
+	if (search != unjoined.end()) {
+		auto & same = search->second;
+		for (auto it = same.begin(); it != same.end(); ++it) {
+			if (it->getPollHandle() == ws.getPollHandle()) {
+				same.erase(it);
+				break;
+			}
+		}
+		if (same.empty()) {
+			unjoined.erase(search);
+		}
+	}
+	si->unjoined = false;
+}
+
 bool Server::is_adminpw(const std::string& pw) {
 	return pw == adminpw;
 }
@@ -303,6 +605,7 @@ bool Server::is_devpw(const std::string& pw) {
 }
 
 uint32_t Server::get_conns(const std::string& ip) {
+	std::lock_guard<std::mutex> lck(listlock);
 	auto search = conns.find(ip);
 	if (search != conns.end()) {
 		return search->second;
@@ -311,106 +614,154 @@ uint32_t Server::get_conns(const std::string& ip) {
 }
 
 void Server::admintell(const std::string & msg) {
-	for (auto client : connsws) {
-		SocketInfo const * const si = (SocketInfo *)client.getUserData();
-		if (si->player && si->player->is_admin()) {
-			si->player->tell(msg);
+	on_worlds([msg](World * const w) {
+		for (Client * const cl : w->get_clis(Client::ADMIN)) {
+			cl->tell(msg);
 		}
-	}
+	});
 }
 
 void Server::kickall(World * const wrld) {
-	for (auto it = connsws.begin(); it != connsws.end();) {
-		auto client = *it++;
-		SocketInfo const * const si = (SocketInfo *)client.getUserData();
-		if (si->player && si->player->get_world() == wrld && !si->player->is_admin()) {
-			si->player->safedelete(true);
+	wrld->shard->exec([wrld] {
+		/* Kicking the last one unloads the world, it's deleted later though */
+		const std::set<Client *> clients(*wrld->get_pl());
+		for (Client * const cl : clients) {
+			if (!cl->is_admin()) {
+				cl->safedelete(true);
+			}
 		}
-	}
+	});
 }
 
 void Server::kickall() {
-	for (auto it = connsws.begin(); it != connsws.end();) {
-		auto client = *it++;
+	for_each_socket([](uWS::WebSocket<uWS::SERVER> client) {
 		SocketInfo const * const si = (SocketInfo *)client.getUserData();
 		if (si->player && !si->player->is_admin()) {
 			si->player->safedelete(true);
 		} else if (!si->player) {
 			client.close();
 		}
-	}
+	});
 }
 
 void Server::kickip(const std::string & ip) {
-	bool useless = true;
-	for (auto it = connsws.begin(); it != connsws.end();) {
-		auto client = *it++;
-		SocketInfo const * const si = (SocketInfo *)client.getUserData();
-		if (si->ip == ip) {
-			useless = false;
-			client.close();
-		}
-	}
-	if (!useless) {
-		admintell("DEVKicked IP: " + ip);
-		conns.erase(ip);
+	/* The connection count drops as each shard closes its sockets */
+	if (get_conns(ip) == 0) {
+		return;
 	}
+	shards[0]->exec([this, ip] {
+		const auto search = unjoined.find(ip);
+		if (search != unjoined.end()) {
+			const std::vector<uWS::WebSocket<uWS::SERVER>> same(search->second);
+			for (auto client : same) {
+				client.close();
+			}
+		}
+	});
+	on_worlds([ip](World * const w) {
+		for (Client * const cl : w->get_clis(ip)) {
+			cl->get_ws().close();
+		}
+	});
+	admintell("DEVKicked IP: " + ip);
 }
 
 void Server::banip(const std::string & ip) {
-	if (ipban.emplace(ip).second) {
+	bool added;
+	{
+		std::lock_guard<std::mutex> lck(listlock);
+		added = ipban.add(ip);
+	}
+	if (added) {
 		admintell("DEVBanned IP: " + ip);
-		auto search = conns.find(ip);
-		if (search != conns.end()) {
-			kickip(ip);
-		}
+		kickip(ip);
 	}
 }
 
-std::unordered_set<std::string> * Server::getbans() {
+IpSet * Server::getbans() {
 	return &ipban;
 }
 
-std::unordered_set<std::string> * Server::getwhitelist() {
+IpSet * Server::getwhitelist() {
 	return &ipwhitelist;
 }
 
-std::unordered_set<std::string> * Server::getblacklist() {
+IpSet * Server::getblacklist() {
 	return &ipblacklist;
 }
 
 void Server::whitelistip(const std::string & ip) {
-	if (ipwhitelist.emplace(ip).second) {
+	bool added;
+	{
+		std::lock_guard<std::mutex> lck(listlock);
+		added = ipwhitelist.add(ip);
+	}
+	if (added) {
 		admintell("DEVWhitelisted IP: " + ip);
 	}
 }
 
+/* IPv4 /24 or IPv6 /64 */
+static std::string subnet_of(const std::string& ip) {
+	uint8_t addr[16];
+	if (inet_pton(AF_INET6, ip.c_str(), addr) == 1) {
+		return std::string((char *)addr, 8);
+	}
+	return ip.substr(0, ip.rfind('.'));
+}
+
+bool Server::can_connect(const std::string& ip) {
+	/* An IP over its limit doesn't take from its subnet's or the global one */
+	return iplimiter.can_spend(ip) && subnetlimiter.can_spend(subnet_of(ip)) && connlimiter.can_spend();
+}
+
 void Server::set_max_ip_conns(uint8_t max) {
 	maxconns = max;
-	bool remaining = true;
-	while (remaining) {
-		remaining = false;
-		for (auto client : connsws) {
-			SocketInfo const * const si = (SocketInfo *)client.getUserData();
-			auto search = conns.find(si->ip);
-			if (search != conns.end() && search->second > max) {
-				remaining = true;
-				if (si->player) {
-					if (si->player->is_admin()) {
-						remaining = false;
-						continue;
-					}
-					si->player->safedelete(true);
-				} else {
-					client.close();
-				}
-				break;
+	std::vector<std::string> over;
+	{
+		std::lock_guard<std::mutex> lck(listlock);
+		for (const auto& conn : conns) {
+			if (conn.second > max) {
+				over.push_back(conn.first);
 			}
 		}
 	}
+	/* Closing a socket updates the count, so each IP keeps 'max' of them */
+	shards[0]->exec([this, over, max] {
+		for (const auto& ip : over) {
+			const auto search = unjoined.find(ip);
+			if (search == unjoined.end()) {
+				continue;
+			}
+			const std::vector<uWS::WebSocket<uWS::SERVER>> same(search->second);
+			for (auto client : same) {
+				if (get_conns(ip) <= max) {
+					break;
+				}
+				client.close();
+			}
+		}
+	});
+	on_worlds([this, over, max](World * const w) {
+		for (const auto& ip : over) {
+			for (Client * const cl : w->get_clis(ip)) {
+				if (get_conns(ip) <= max) {
+					break;
+				}
+				if (!cl->is_admin()) {
+					cl->safedelete(true);
+				}
+			}
+		}
+	});
 }
 
 void Server::set_captcha_protection(bool state) {
+	if (state && sizeof(SERVER_CAPTCHA_SECRET) == 1) {
+		/* Every token would be rejected, kicking everyone */
+		admintell("DEVCaptcha protection needs SERVER_CAPTCHA_SECRET in config.hpp, not enabled.");
+		return;
+	}
 	captcha_required = state;
 	if (captcha_required) {
 		admintell("DEVCaptcha protection enabled.");
@@ -420,10 +771,12 @@ void Server::set_captcha_protection(bool state) {
 }
 
 void Server::lockdown_check() {
-	for (auto & ip : ipwhitelist) {
-		auto search = conns.find(ip);
-		if (search != conns.end() && search->second > 0) {
-			return;
+	{
+		std::lock_guard<std::mutex> lck(listlock);
+		for (auto & conn : conns) {
+			if (conn.second > 0 && ipwhitelist.contains(conn.first)) {
+				return;
+			}
 		}
 	}
 	set_lockdown(false);
@@ -432,12 +785,12 @@ void Server::lockdown_check() {
 void Server::set_lockdown(bool state) {
 	lockdown = state;
 	if (lockdown) {
-		for (auto client : connsws) {
-			SocketInfo const * const si = (SocketInfo *)client.getUserData();
-			if (si->player && si->player->is_admin()) {
-				ipwhitelist.emplace(si->ip);
+		on_worlds([this](World * const w) {
+			std::lock_guard<std::mutex> lck(listlock);
+			for (Client * const cl : w->get_clis(Client::ADMIN)) {
+				ipwhitelist.add(cl->si->ip);
 			}
-		}
+		});
 		admintell("DEVLockdown mode enabled.");
 	} else {
 		//ipwhitelist.clear();
@@ -448,18 +801,12 @@ void Server::set_lockdown(bool state) {
 void Server::set_instaban(bool state) {
 	instaban = state;
 	if (instaban) {
-		bool remaining = true;
-		while (remaining) {
-			remaining = false;
-			for (auto client : connsws) {
-				SocketInfo const * const si = (SocketInfo *)client.getUserData();
-				if (si->origin == "(None)") {
-					remaining = true;
-					client.close();
-					break;
-				}
+		for_each_socket([](uWS::WebSocket<uWS::SERVER> client) {
+			SocketInfo const * const si = (SocketInfo *)client.getUserData();
+			if (si->origin == "(None)") {
+				client.close();
 			}
-		}
+		});
 		admintell("DEVSuspicious banning enabled.");
 	} else {
 		admintell("DEVSuspicious banning disabled.");
@@ -467,44 +814,142 @@ void Server::set_instaban(bool state) {
 }
 
 void Server::set_proxycheck(bool state) {
+	if (state && sizeof(SERVER_PROXYCHECK_CONTACT) == 1) {
+		/* getipintel.net refuses lookups without a contact, each one would just fail open */
+		admintell("DEVProxy check needs SERVER_PROXYCHECK_CONTACT in config.hpp, not enabled.");
+		return;
+	}
 	proxy_lock = state;
 	if (!proxy_lock) {
-		/* Removes all pending requests with this url */
-		hcli.removeRequests("http://check.getipintel.net/check.php");
-		for (auto & ip : proxyquery_checking) {
+		/* Removes all pending requests with this url, the HTTP client runs on the main loop */
+		shards[0]->exec([this] {
+			hcli.removeRequests(SERVER_PROXYCHECK_URL);
+		});
+		std::unordered_set<std::string> checking;
+		{
+			std::lock_guard<std::mutex> lck(listlock);
+			checking.swap(proxyquery_checking);
+		}
+		for (auto & ip : checking) {
 			/* Kick these IPs because we're not sure if they are proxies or not */
 			kickip(ip);
 		}
-		proxyquery_checking.clear();
 		admintell("DEVProxy check disabled.");
 	} else {
 		admintell("DEVProxy check enabled.");
 	}
 }
 
-bool Server::is_connected(const uWS::WebSocket<uWS::SERVER> ws) {
-	return connsws.find(ws) != connsws.end();
+void Server::check_proxy(const std::string& ip) {
+	{
+		/* Other connections from this IP wait for the same lookup */
+		std::lock_guard<std::mutex> lck(listlock);
+		if (!proxyquery_checking.emplace(ip).second) {
+			return;
+		}
+	}
+	hcli.queueRequest(AsyncHTTPGETClient::Request(SERVER_PROXYCHECK_URL,
+			"ip=" + ip + "&contact=" SERVER_PROXYCHECK_CONTACT "&flags=m",
+			[this, ip](CURL * const, const CURLcode code, const std::string & resp) {
+		{
+			std::lock_guard<std::mutex> lck(listlock);
+			proxyquery_checking.erase(ip);
+		}
+		double score = -1.0; /* Negative scores are errors */
+		if (code == CURLE_OK) {
+			try {
+				score = std::stod(resp);
+			} catch(std::exception& e) { }
+		}
+		const bool isproxy = score >= SERVER_PROXYCHECK_THRESHOLD;
+		if (score >= 0.0) {
+			reputation.set(ip, IpReputation::PROXY_CHECK, isproxy, SERVER_REPUTATION_PROXY_TTL);
+		} else {
+			std::cerr << "Proxy check of " << ip << " failed: " << resp << std::endl;
+		}
+		h.getDefaultGroup<uWS::SERVER>().forEach([ip, isproxy](uWS::WebSocket<uWS::SERVER> ws) {
+			SocketInfo * const si = (SocketInfo *)ws.getUserData();
+			if (si->ip != ip || !si->proxywait) {
+				return;
+			}
+			si->proxywait = false;
+			if (isproxy) {
+				std::string m("Sorry, proxies and VPNs are not allowed.");
+				ws.send(m.c_str(), m.size(), uWS::TEXT);
+				ws.close();
+				return;
+			}
+			uint8_t captcha_request[2] = {CAPTCHA_REQUIRED, si->captcha_verified};
+			ws.send((const char *)&captcha_request[0], sizeof(captcha_request), uWS::BINARY);
+		});
+		if (isproxy) {
+			admintell("DEVProxy detected: " + ip);
+		}
+	}));
+}
+
+void Server::verify_captcha(uWS::WebSocket<uWS::SERVER> ws, const std::string& token) {
+	SocketInfo * const si = (SocketInfo *)ws.getUserData();
+	const bool valid = !token.empty() && token.size() <= 4096 && std::all_of(token.begin(), token.end(), [](const char c) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+	});
+	si->captcha_verified = valid ? CA_VERIFYING : CA_INVALID;
+	uint8_t captcha_request[2] = {CAPTCHA_REQUIRED, si->captcha_verified};
+	ws.send((const char *)&captcha_request[0], sizeof(captcha_request), uWS::BINARY);
+	if (!valid) {
+		ws.close();
+		return;
+	}
+	const std::string ip(si->ip);
+	hcli.queueRequest(AsyncHTTPGETClient::Request(SERVER_CAPTCHA_VERIFY_URL,
+			"secret=" SERVER_CAPTCHA_SECRET "&response=" + token,
+			[this, ip](CURL * const, const CURLcode code, const std::string & resp) {
+		bool solved = false;
+		if (code == CURLE_OK) {
+			try {
+				solved = nlohmann::json::parse(resp).value("success", false);
+			} catch(std::exception& e) { }
+		}
+		if (solved) {
+			reputation.set(ip, IpReputation::CAPTCHA, 1, SERVER_REPUTATION_CAPTCHA_TTL);
+		}
+		/* The result counts for the IP, not just the socket that sent the token */
+		h.getDefaultGroup<uWS::SERVER>().forEach([ip, solved](uWS::WebSocket<uWS::SERVER> ws) {
+			SocketInfo * const si = (SocketInfo *)ws.getUserData();
+			if (si->ip != ip || si->captcha_verified != CA_VERIFYING) {
+				return;
+			}
+			si->captcha_verified = solved ? CA_OK : CA_INVALID;
+			uint8_t captcha_request[2] = {CAPTCHA_REQUIRED, si->captcha_verified};
+			ws.send((const char *)&captcha_request[0], sizeof(captcha_request), uWS::BINARY);
+			if (!solved) {
+				ws.close();
+			}
+		});
+	}));
 }
 
 void Server::writefiles() {
+	std::lock_guard<std::mutex> lck(listlock);
 	std::ofstream file("bans.txt", std::ios_base::trunc);
-	for (auto & ip : ipban) {
+	ipban.for_each([&file](const std::string& ip) {
 		file << ip << std::endl;
-	}
+	});
 	file.flush();
 	file.close();
 	file.open("whitelist.txt", std::ios_base::trunc);
-	for (auto & ip : ipwhitelist) {
+	ipwhitelist.for_each([&file](const std::string& ip) {
 		file << ip << std::endl;
-	}
+	});
 	file.flush();
 	file.close();
 	file.open("blacklist.txt", std::ios_base::trunc);
-	for (auto & ip : ipblacklist) {
+	ipblacklist.for_each([&file](const std::string& ip) {
 		file << ip << std::endl;
-	}
+	});
 	file.flush();
 	file.close();
+	reputation.save("reputation.bin");
 }
 
 void Server::readfiles() {
@@ -512,8 +957,8 @@ void Server::readfiles() {
 	std::ifstream file("bans.txt");
 	while (file.good()) {
 		std::getline(file, ip);
-		if (ip.size() > 0) {
-			ipban.emplace(ip);
+		if (ip.size() > 0 && !ipban.add(ip) && !IpSet::valid(ip)) {
+			std::cerr << "Invalid IP or range in bans.txt: " << ip << std::endl;
 		}
 		ip.clear();
 	}
@@ -522,8 +967,8 @@ void Server::readfiles() {
 	file.open("whitelist.txt");
 	while (file.good()) {
 		std::getline(file, ip);
-		if (ip.size() > 0) {
-			ipwhitelist.emplace(ip);
+		if (ip.size() > 0 && !ipwhitelist.add(ip) && !IpSet::valid(ip)) {
+			std::cerr << "Invalid IP or range in whitelist.txt: " << ip << std::endl;
 		}
 		ip.clear();
 	}
@@ -532,11 +977,12 @@ void Server::readfiles() {
 	file.open("blacklist.txt");
 	while (file.good()) {
 		std::getline(file, ip);
-		if (ip.size() > 0) {
-			ipblacklist.emplace(ip);
+		if (ip.size() > 0 && !ipblacklist.add(ip) && !IpSet::valid(ip)) {
+			std::cerr << "Invalid IP or range in blacklist.txt: " << ip << std::endl;
 		}
 		ip.clear();
 	}
 	file.close();
 	std::cout << ipblacklist.size() << " blacklists read." << std::endl;
+	std::cout << reputation.load("reputation.bin") << " IP reputations read." << std::endl;
 }
@@ -9,19 +9,33 @@
 #include <unordered_set>
 #include <cstdio>
 #include <set>
+#include <list>
+#include <vector>
+#include <deque>
+#include <bitset>
 #include <fstream>
 #include <memory>
 #include <atomic>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
 #include "limiter.hpp"
 #include "config.hpp"
 
 #include "AsyncHTTPGETClient.hpp"
 #include "TaskBuffer.hpp"
+#include "TimerWheel.hpp"
+#include "WorkerPool.hpp"
+#include "RegionCache.hpp"
+#include "IpReputation.hpp"
+#include "IpSet.hpp"
+#include "WriteAheadLog.hpp"
 
 class Client;
 class Chunk;
 class World;
+class Shard;
 class Server;
 
 size_t getUTF8strlen(const std::string& str);
@@ -30,6 +44,10 @@ inline std::string key(int32_t i, int32_t j) {
 	return std::string((char *)&i, sizeof(i)) + std::string((char *)&j, sizeof(j));
 };
 
+inline uint64_t key64(int32_t i, int32_t j) {
+	return (uint64_t)(uint32_t)j << 32 | (uint32_t)i;
+};
+
 enum server_messages : uint8_t {
 	SET_ID,
 	UPDATE,
@@ -41,6 +59,28 @@ enum server_messages : uint8_t {
 	CHUNK_PROTECTED
 };
 
+/* Sent after the world name when joining. Anything unknown (the original client sends 1337)
+ * gets the legacy messages. */
+enum client_protocol : uint16_t {
+	PROTO_LEGACY = 1337,
+	PROTO_COMPACT_UPDATES = 1338 /* UPDATE pixels grouped by chunk, see World::send_updates */
+};
+
+/* Client messages are told apart by their length (see Server::onMessage),
+ * these ones start with an exthdr_t instead, followed by 'count' items.
+ * Their length is never one of the fixed message lengths. */
+enum client_messages : uint8_t {
+	UNSUBSCRIBE = 1, /* chunkpos_t items: stop sending updates of these chunks */
+	PAINT = 2, /* pixupd_t items */
+	PAINT_LINE = 3, /* paintline_t items */
+	PAINT_RECT = 4 /* paintrect_t items */
+};
+
+struct exthdr_t {
+	uint8_t op;
+	uint32_t count;
+} __attribute__((packed));
+
 struct pinfo_t {
 	int32_t x;
 	int32_t y;
@@ -58,11 +98,100 @@ struct pixupd_t {
 	uint8_t b;
 } __attribute__((packed));
 
+/* Both ends are painted */
+struct paintline_t {
+	int32_t x1;
+	int32_t y1;
+	int32_t x2;
+	int32_t y2;
+	uint8_t r;
+	uint8_t g;
+	uint8_t b;
+} __attribute__((packed));
+
+struct paintrect_t {
+	int32_t x;
+	int32_t y;
+	uint16_t w;
+	uint16_t h;
+	uint8_t r;
+	uint8_t g;
+	uint8_t b;
+} __attribute__((packed));
+
 struct chunkpos_t {
 	int32_t x;
 	int32_t y;
 };
 
+struct pendingload_t {
+	std::vector<uint32_t> waiting; /* Client IDs */
+	bool stale; /* The chunk was loaded synchronously while this read was running */
+};
+
+/* Changed chunks copied on the loop by World::snapshot, written by the save thread */
+struct snapshot_t {
+	struct entry_t {
+		int32_t x;
+		int32_t y;
+		uint32_t version;
+		uint32_t offset; /* In 'arena' */
+		uint64_t since; /* When the chunk became dirty */
+		bool saved;
+	};
+	std::vector<entry_t> entries; /* In region order once sorted */
+	std::vector<char> arena;
+	uint64_t oldest; /* Smallest 'since' */
+};
+
+/* The log file 'segment' was closed at 'time', see World::drop_logs */
+struct logboundary_t {
+	uint64_t segment;
+	uint64_t time;
+};
+
+struct mover_t {
+	uint64_t cell;
+	uint32_t order; /* Index in tickarena_t::moved */
+	uint32_t slot;
+};
+
+struct pxchunk_t {
+	uint64_t chunk;
+	uint32_t start; /* Index in tickarena_t::pixels */
+	uint32_t count;
+};
+
+struct frameent_t {
+	uint64_t hash;
+	uint64_t cell;
+	uint32_t keyoff; /* Subscribed dirty chunks, in tickarena_t::framekeys */
+	uint32_t keylen;
+	bool hascell;
+	bool compact;
+	uWS::WebSocket<uWS::SERVER>::PreparedMessage * prep; /* nullptr if empty */
+};
+
+/* Scratch space of World::send_updates, kept between ticks so they don't allocate */
+struct tickarena_t {
+	std::vector<uint32_t> moved; /* Slots, in update order */
+	std::vector<mover_t> movers; /* Sorted by cell */
+	std::vector<uint8_t> resend;
+	std::vector<mover_t> far;
+	std::vector<uint8_t> farresend;
+	std::vector<uint32_t> near;
+	std::vector<uint32_t> players;
+	std::vector<pixupd_t> pixels; /* Grouped by chunk */
+	std::vector<pxchunk_t> pxchunks; /* Sorted by chunk */
+	std::vector<uint64_t> dirtychunks; /* Same order as pxchunks */
+	std::vector<uint64_t> resends; /* Chunks sent whole */
+	std::vector<uint16_t> subscribed;
+	std::vector<uint16_t> framekeys;
+	std::vector<frameent_t> frames;
+	std::vector<uint32_t> frametable; /* Open addressing, indices in 'frames' */
+	std::vector<uint8_t> buf;
+};
+
 struct RGB {
 	uint8_t r;
 	uint8_t g;
@@ -82,6 +211,11 @@ struct SocketInfo {
 	std::string ip;
 	Client * player;
 	std::atomic<uint8_t> captcha_verified;
+	bool proxywait; /* Can't join until the proxy check of its IP is done */
+	bool unjoined; /* In Server::unjoined */
+	/* Join request carried to the world's shard, see Server::join_world */
+	std::string joinworld;
+	uint16_t joinprotocol;
 };
 
 double ColourDistance(RGB e1, RGB e2);
@@ -89,14 +223,25 @@ double ColourDistance(RGB e1, RGB e2);
 class Database {
 	const std::string dir;
 	bool created_dir;
-	std::unordered_map<std::string, std::fstream *> handles;
+	RegionCache * const regions;
 	std::set<std::string> nonexistant;
 	std::map<std::string, std::string> worldProps;
 	std::unordered_set<uint64_t> rankedChunks;
 	bool changedPropsOrProtects;
+	/* Chunks are also read from the disk worker threads. Guards 'nonexistant' and 'unsynced',
+	 * the files lock themselves (another instance of this world can share them). */
+	std::mutex regionlock;
+	/* Edits since the last checkpoint, opened on the first one */
+	std::shared_ptr<WriteAheadLog> wal;
+	/* Region files written since the last checkpoint, under regionlock */
+	std::set<std::shared_ptr<RegionFile>> unsynced;
+	std::atomic<bool> writefailed; /* A chunk couldn't be saved, so the log is kept */
+	std::mutex writelock;
+	std::condition_variable writecv;
+	uint32_t writes; /* Snapshots queued or being written, guarded by writelock */
 
 public:
-	Database(const std::string& dir);
+	Database(const std::string& dir, RegionCache * const regions);
 	~Database();
 
 	void save();
@@ -107,10 +252,36 @@ public:
 	std::string getProp(std::string key, std::string defval = "");
 	void setProp(std::string key, std::string value);
 
-	std::fstream * get_handle(const int32_t x, const int32_t y, const bool create);
+	std::shared_ptr<RegionFile> get_handle(const int32_t x, const int32_t y, const bool create);
 
+	/* Thread safe */
 	bool get_chunk(const int32_t x, const int32_t y, char * const arr);
-	void set_chunk(const int32_t x, const int32_t y, const char * const arr);
+	bool set_chunk(const int32_t x, const int32_t y, const char * const arr);
+	/* Writes the chunks region by region and flushes the files, sets each entry's 'saved' */
+	bool write_snapshot(snapshot_t&);
+	/* Around each snapshot, so the chunks can be saved right away after wait_writes() */
+	void begin_write();
+	void end_write();
+	void wait_writes();
+
+	/* Edits to log, before they're saved (see WORLD_LOG_SYNC_MSEC) */
+	void log_px(const int32_t x, const int32_t y, const uint8_t r, const uint8_t g, const uint8_t b);
+	void log_chunk(const int32_t x, const int32_t y, const char * const arr);
+	void log_protect(const int32_t x, const int32_t y, const bool state);
+	std::shared_ptr<WriteAheadLog> get_log(const bool create = true);
+	/* After every changed chunk was saved: flushes the region files and empties the log */
+	bool checkpoint();
+	/* Thread safe, flushes the files written since the last snapshot */
+	bool sync_files();
+	/* Thread safe, packs every region file and leaves out the chunks filled with 'bgclr',
+	 * removing the files left empty. Adds up the bytes freed and the chunks left out. */
+	bool compact(const uint32_t bgclr, uint64_t& reclaimed, uint32_t& dropped);
+	/* Thread safe, the log files can't be dropped until the next checkpoint() */
+	bool has_failed() const;
+
+private:
+	bool make_dir();
+	void recover();
 };
 
 class Chunk {
@@ -119,24 +290,47 @@ class Chunk {
 	const int32_t cx;
 	const int32_t cy;
 	uint8_t data[16 * 16 * 3];
-	bool changed;
+	/* Bumped by every change. Saved is on the disk, staged is copied by a snapshot being written. */
+	uint32_t version;
+	uint32_t savedversion;
+	uint32_t stagedversion;
+	uint64_t dirtysince; /* Loop time of the first change not staged yet, 0 if none */
+	bool ranked;
+	/* Cached CHUNKDATA frame, nullptr when it needs to be rebuilt */
+	uWS::WebSocket<uWS::SERVER>::PreparedMessage * prepd;
 
 public:
-	bool ranked;
+	static std::atomic<uint64_t> msgcache_hits;
+	static std::atomic<uint64_t> msgcache_misses;
 
 	Chunk(const int32_t cx, const int32_t cy, const uint32_t bgclr, Database * const);
+	/* Uses data already read from the database, nullptr if it wasn't saved */
+	Chunk(const int32_t cx, const int32_t cy, const uint32_t bgclr, Database * const, char const * const loaded);
 	~Chunk();
 
 	size_t compress_data_to(uint8_t (&msg)[16 * 16 * 3 + 10 + 4]);
+	/* Owned by the chunk, don't finalize it */
 	uWS::WebSocket<uWS::SERVER>::PreparedMessage * get_prepd_data_msg();
 
 	bool set_data(const uint8_t x, const uint8_t y, const RGB);
+	void set_ranked(const bool);
 	void send_data(uWS::WebSocket<uWS::SERVER>, bool compressed = false);
 	void save();
+	/* Returns true if it wasn't dirty, then it goes in the world's dirty queue */
+	bool mark_dirty(const uint64_t now);
+	uint64_t get_dirtysince() const;
+	/* Copies the data to the snapshot if it changed since it was saved or staged */
+	bool stage(snapshot_t&);
+	void staged_written(const uint32_t version, const bool saved);
+	bool is_staged() const;
 
 	void clear();
 	uint8_t * get_data();
 	void set_data(char const * const, size_t);
+
+private:
+	void fill_bg();
+	void invalidate_msg();
 };
 
 class Client {
@@ -151,42 +345,56 @@ private:
 	std::string nick;
 	limiter::Bucket pixupdlimit;
 	limiter::Bucket chatlimit;
-	uv_timer_t idletimeout_hdl;
+	TimerWheel::Timer idletimer; /* Also deletes the client after safedelete() */
+	TimerWheel::Timer warntimer;
 	uWS::WebSocket<uWS::SERVER> ws;
 	World * const wrld;
+	const uint16_t protocol;
 	uint16_t penalty;
 	bool handledelete;
 	uint8_t rank;
 	bool stealthadmin;
 	bool suspicious;
 	bool compressionEnabled;
-	pinfo_t pos;
 	RGB lastclr;
 	bool chathtml;
+	/* Chunks this client has loaded, the least recently requested last */
+	std::list<uint64_t> subscriptionorder;
+	std::unordered_map<uint64_t, std::list<uint64_t>::iterator> subscriptions;
 
 public:
 	const uint32_t id;
 	SocketInfo * si;
 	bool mute;
+	uint32_t slot; /* Player state index in the world, set by World::add_cli */
 
-	Client(const uint32_t id, uWS::WebSocket<uWS::SERVER>, World * const, SocketInfo * si);
+	Client(const uint32_t id, uWS::WebSocket<uWS::SERVER>, World * const, SocketInfo * si, const uint16_t protocol);
 	~Client();
 
 	bool can_edit();
 
-	void get_chunk(const int32_t x, const int32_t y) const;
+	void get_chunk(const int32_t x, const int32_t y);
 	void put_px(const int32_t x, const int32_t y, const RGB);
+	/* Charged to the pixel bucket as a whole, reordered by chunk */
+	void put_pxs(std::vector<pixupd_t>&);
+
+	void subscribe(const int32_t x, const int32_t y);
+	void unsubscribe(const int32_t x, const int32_t y);
+	bool is_subscribed(const uint64_t chunk) const;
+	const std::list<uint64_t> & get_subscriptions() const;
 
 	void teleport(const int32_t x, const int32_t y);
 	void move(const pinfo_t&);
-	const pinfo_t * get_pos();
+	pinfo_t get_pos() const;
 
 	bool can_chat();
 	void chat(const std::string&);
 	void tell(const std::string&);
 
 	void updated();
-	static void idle_timeout(uv_timer_t * const);
+	static void idle_timeout(TimerWheel::Timer * const);
+	static void warn_decay(TimerWheel::Timer * const);
+	static void destroy(TimerWheel::Timer * const);
 
 	void safedelete(const bool close);
 
@@ -203,6 +411,7 @@ public:
 	World * get_world() const;
 	uint16_t get_penalty() const;
 	uint8_t get_rank() const;
+	uint16_t get_protocol() const;
 
 	void set_stealth(bool);
 	void set_nick(const std::string&);
@@ -216,17 +425,66 @@ class World {
 	uint8_t defaultRank;
 	uv_timer_t upd_hdl;
 	Database db;
+	WorkerPool * const diskpool;
+	WorkerPool * const savepool;
+	bool unloading;
+	bool logflushing; /* A batch of the edit log is being written by the disk workers */
+	uint32_t snapshots; /* Snapshots (or compactions) being written by the save thread */
+	/* Chunks by the time they became dirty, oldest first. Entries of chunks saved or
+	 * unloaded since are skipped (their 'dirtysince' doesn't match). */
+	std::deque<std::pair<uint64_t, uint64_t>> dirtyqueue;
+	std::deque<uint64_t> snapshotoldest; /* Of the snapshots being written, in order */
+	std::deque<logboundary_t> logboundaries;
+	uint64_t logstart; /* Loop time the current log file was started */
+	bool logged; /* Since then */
+	TimerWheel::Timer cptimer;
+	TimerWheel::Timer logtimer;
 	std::string pass;
 	std::set<Client *> clients;
+	/* Indexes of 'clients', by get_nick() (the id for players without a nick) */
+	std::unordered_map<uint32_t, Client *> clientsbyid;
+	std::unordered_multimap<std::string, Client *> clientsbynick;
+	std::unordered_map<std::string, std::vector<Client *>> clientsbyip;
+	std::unordered_set<Client *> clientsbyrank[Client::ADMIN + 1];
 	std::unordered_map<std::string, Chunk *> chunks;
-	std::vector<pixupd_t> pxupdates;
-	std::set<Client *> plupdates;
-	std::set<uint32_t> plleft;
+	std::unordered_map<std::string, pendingload_t> pendingloads;
+	/* Pixels changed since the last update by chunk, and the chunks in the order they changed.
+	 * Each pixel is sent once per update with its latest color. */
+	std::unordered_map<uint64_t, std::bitset<256>> pxdirty;
+	std::deque<uint64_t> pxdirtyorder;
+	/* Player state by slot, free slots are reused by the next player that joins */
+	std::vector<Client *> plclient;
+	std::vector<int32_t> plx;
+	std::vector<int32_t> ply;
+	std::vector<RGB> plclr;
+	std::vector<uint8_t> pltool;
+	std::vector<uint64_t> plcell;
+	std::vector<uint32_t> plcellpos; /* Index in grid[plcell] */
+	std::vector<uint32_t> freeslots;
+	/* Players by position (see WORLD_PLAYER_CELL_SHIFT) */
+	std::unordered_map<uint64_t, std::vector<uint32_t>> grid;
+	/* Slot bitsets: moved since the last update, and not yet sent to far away viewers */
+	std::vector<uint64_t> pldirty;
+	std::vector<uint64_t> plfardirty;
+	uint32_t plstart; /* Slot that goes first next update */
+	std::vector<uint32_t> plleft;
+	uint32_t ticks;
+	tickarena_t arena;
+	std::atomic<uint32_t> online; /* clients.size(), for other threads */
+
+public:
+	/* Of every world: chunks saved by checkpoints, and how long they were dirty */
+	static std::atomic<uint64_t> chunks_saved;
+	static std::atomic<uint64_t> save_latency_total;
+	static std::atomic<uint64_t> save_latency_max;
+	static std::atomic<int64_t> chunks_queued;
 
 public:
 	const std::string name;
+	/* Everything but get_online() must be called from this shard's thread */
+	Shard * const shard;
 
-	World(const std::string& path, const std::string& name);
+	World(const std::string& path, const std::string& name, Shard * const shard, WorkerPool * const diskpool, WorkerPool * const savepool, RegionCache * const regions);
 	~World();
 
 	void update_all_clients();
@@ -240,9 +498,17 @@ public:
 	uint32_t get_id();
 	void add_cli(Client * const);
 	void upd_cli(Client * const);
+	void move_cli(Client * const, const pinfo_t&);
+	pinfo_t get_pos(const uint32_t slot) const;
 	void rm_cli(Client * const);
 	Client * get_cli(const uint32_t id) const;
 	Client * get_cli(const std::string name) const;
+	/* A copy, so they can be kicked while going through it */
+	std::vector<Client *> get_clis(const std::string& ip) const;
+	const std::unordered_set<Client *> & get_clis(const uint8_t rank) const;
+	/* Called by the client, after it changed */
+	void rank_changed(Client * const, const uint8_t oldrank);
+	void nick_changed(Client * const, const std::string& oldnick);
 
 	std::set<Client *> * get_pl();
 
@@ -250,18 +516,51 @@ public:
 	static void send_updates(uv_timer_t * const);
 
 	Chunk * get_chunk(const int32_t x, const int32_t y, bool create = true);
-	void send_chunk(uWS::WebSocket<uWS::SERVER>, const int32_t x, const int32_t y, bool compressed = false);
+	void send_chunk(Client const * const, const int32_t x, const int32_t y, bool compressed = false);
+	void load_chunk(const int32_t x, const int32_t y);
+	void chunk_loaded(const int32_t x, const int32_t y, char const * const data);
 	void del_chunk(const int32_t x, const int32_t y);
 	void paste_chunk(const int32_t x, const int32_t y, char const * const);
 	bool put_px(const int32_t x, const int32_t y, const RGB, uint8_t placerRank);
+	void put_pxs(std::vector<pixupd_t>&, uint8_t placerRank);
 
 	void safedelete();
 
 	void broadcast(const std::string& msg) const;
 
+	/* Blocks until every changed chunk is on the disk */
 	void save();
+	/* Copies every changed chunk and writes them on the save thread */
+	void snapshot();
+	/* Same with the oldest ones, see WORLD_CHECKPOINT_BUDGET_BYTES */
+	void checkpoint(const uint64_t now, const size_t budget);
+	/* Packs the region files on the save thread (see Database::compact), then calls 'done' here */
+	void compact(const std::function<void(const bool ok, const uint64_t reclaimed, const uint32_t dropped)>& done);
+	void sched_checkpoint();
+	static void checkpoint_timeout(TimerWheel::Timer * const);
+	void sched_log();
+	void flush_log();
+	static void log_timeout(TimerWheel::Timer * const);
 
+private:
+	static bool is_valid_chunk(const int32_t x, const int32_t y);
+	static uint8_t rank_index(const uint8_t rank);
+	static uint64_t player_cell(const int32_t x, const int32_t y);
+	void grid_add(const uint32_t slot);
+	void grid_rm(const uint32_t slot);
+	Chunk * add_chunk(const std::string& key, Chunk * const);
+	void chunk_changed(Chunk * const, const int32_t x, const int32_t y);
+	void write_snapshot(const std::shared_ptr<snapshot_t>&);
+	/* Starts a new log file, and removes the old ones once their edits are saved */
+	void rotate_log(const uint64_t now);
+	void drop_logs();
+	/* Once nothing running on other threads uses the world */
+	void try_close();
+	void close();
+
+public:
 	bool is_empty() const;
+	uint32_t get_online() const;
 	bool is_pass(std::string const&) const;
 	void set_default_rank(uint8_t);
 	uint8_t get_default_rank();
@@ -323,6 +622,47 @@ public:
 	static void sayraw(Server * const, const Commands * const, Client * const, const std::vector<std::string>& args);
 	static void tellraw(Server * const, const Commands * const, Client * const, const std::vector<std::string>& args);
 	static void broadcast(Server * const, const Commands * const, Client * const, const std::vector<std::string>& args);
+	static void stats(Server * const, const Commands * const, Client * const, const std::vector<std::string>& args);
+	static void compact(Server * const, const Commands * const, Client * const, const std::vector<std::string>& args);
+};
+
+/* An event loop running on its own thread. Every world belongs to one shard and the
+ * sockets of its players are moved to it when they join, see Server::join_world.
+ * Shard 0 runs on the main loop, the one accepting connections. */
+class Shard {
+	Server * const srv;
+	uWS::Hub * hub;
+	uWS::Group<uWS::SERVER> * group;
+	TaskBuffer * tasks;
+	TimerWheel * timers;
+	std::thread thread;
+	std::thread::id tid;
+
+public:
+	const uint32_t index;
+
+	Shard(Server * const, const uint32_t index);
+	~Shard();
+
+	bool is_current() const;
+	/* Thread safe, runs the function on this shard's loop */
+	void post(const std::function<void(void)>&);
+	/* Same, but runs it right away when called from this shard */
+	void exec(const std::function<void(void)>&);
+
+	uWS::Group<uWS::SERVER> * get_group() const;
+	uv_loop_t * get_loop() const;
+	TaskBuffer * get_tasks() const;
+	TimerWheel * get_timers() const;
+
+	/* Moves a socket from the current loop to this shard, it joins si->joinworld when it arrives */
+	void adopt(uWS::WebSocket<uWS::SERVER>);
+	/* Closes the shard's sockets and waits for its thread, which deletes the worlds left */
+	void stop();
+
+private:
+	void loop_thread(std::mutex&, std::condition_variable&, bool& ready);
+	static void adopted(uv_poll_t * const);
 };
 
 class Server {
@@ -335,24 +675,41 @@ public:
 	const Commands cmds;
 	uv_timer_t save_hdl;
 	std::unordered_map<std::string, World *> worlds;
-	std::unordered_set<uWS::WebSocket<uWS::SERVER>> connsws;
-	std::unordered_set<std::string> ipwhitelist;
-	std::unordered_set<std::string> ipblacklist;
-	std::unordered_set<std::string> ipban;
+	std::mutex worldlock; /* Guards 'worlds', a world can only be added or removed by its shard */
+	std::mutex listlock; /* Guards the IP lists, 'conns' and 'proxyquery_checking' */
+	IpSet ipwhitelist;
+	IpSet ipblacklist;
+	IpSet ipban;
 	std::unordered_map<std::string, uint8_t> conns;
 	limiter::Bucket connlimiter;
+	limiter::Table iplimiter;
+	limiter::Table subnetlimiter;
 	uWS::Hub h;
 	AsyncHTTPGETClient hcli;
-	TaskBuffer async_tasks;
-	uint32_t maxconns;
-	bool captcha_required;
-	bool lockdown;
-	bool proxy_lock;
-	bool instaban;
-	bool trusting_captcha;
-	uint8_t fastconnectaction;
+	WorkerPool diskpool;
+	WorkerPool savepool; /* One thread, snapshots are written in the order they're taken */
+	RegionCache regions;
+	IpReputation reputation;
+	std::vector<Shard *> shards;
+	std::function<void(uWS::WebSocket<uWS::SERVER>, char *, size_t, uWS::OpCode)> msghandler;
+	std::function<void(uWS::WebSocket<uWS::SERVER>, int, char *, size_t)> dischandler;
+	std::atomic<uint32_t> connections;
+	std::atomic<uint32_t> maxconns;
+	std::atomic<bool> captcha_required;
+	std::atomic<bool> lockdown;
+	std::atomic<bool> proxy_lock;
+	std::atomic<bool> instaban;
+	std::atomic<bool> trusting_captcha;
+	std::atomic<uint8_t> fastconnectaction;
+	/* Connections closed on accept, before the HTTP upgrade */
+	std::atomic<uint64_t> rejected_banned;
+	std::atomic<uint64_t> rejected_lockdown;
+	std::atomic<uint64_t> rejected_conns;
+	std::atomic<uint64_t> rejected_fast;
 
 	std::unordered_set<std::string> proxyquery_checking;
+	/* Sockets by IP that didn't join a world yet, main loop only */
+	std::unordered_map<std::string, std::vector<uWS::WebSocket<uWS::SERVER>>> unjoined;
 
 	Server(const uint16_t port, const std::string& modpw, const std::string& adminpw, const std::string& devpw, const std::string& path);
 	~Server();
@@ -363,14 +720,23 @@ public:
 	void quit();
 
 	void save_now();
-	static void save_chunks(uv_timer_t * const);
-
-	void join_world(uWS::WebSocket<uWS::SERVER>, const std::string&);
+	/* Edits of worlds that weren't saved before the last exit, see WORLD_LOG_SYNC_MSEC */
+	void recover_worlds();
+	static void save_files(uv_timer_t * const);
+
+	void join_world(uWS::WebSocket<uWS::SERVER>, const std::string&, const uint16_t protocol);
+	Shard * get_shard(const std::string& worldname) const;
+	/* Runs the function on every shard, right away on the current one */
+	void on_shards(const std::function<void(Shard * const)>&);
+	void for_each_socket(const std::function<void(uWS::WebSocket<uWS::SERVER>)>&);
+	/* Runs the function on every world, from the world's shard */
+	void on_worlds(const std::function<void(World * const)>&);
 
 	bool is_adminpw(const std::string&);
 	bool is_modpw(const std::string&);
   bool is_devpw(const std::string&);
-	uint32_t get_conns(const std::string&);
+	uint32_t get_conns(const std::string&); /* Thread safe */
+	bool can_connect(const std::string& ip); /* Main loop only, spends from the connection limiters */
 
 	void admintell(const std::string&);
 
@@ -379,9 +745,10 @@ public:
 	void kickip(const std::string&);
 
 	void banip(const std::string&);
-	std::unordered_set<std::string> * getbans();
-	std::unordered_set<std::string> * getwhitelist();
-	std::unordered_set<std::string> * getblacklist();
+	/* Hold listlock while using these */
+	IpSet * getbans();
+	IpSet * getwhitelist();
+	IpSet * getblacklist();
 	void whitelistip(const std::string&);
 
 	void set_max_ip_conns(uint8_t);
@@ -390,8 +757,11 @@ public:
 	void set_lockdown(bool);
 	void set_instaban(bool);
 	void set_proxycheck(bool);
-
-	bool is_connected(const uWS::WebSocket<uWS::SERVER>);
+	/* These run on the main loop, before the client joins */
+	void unjoined_add(uWS::WebSocket<uWS::SERVER>);
+	void unjoined_rm(uWS::WebSocket<uWS::SERVER>);
+	void check_proxy(const std::string& ip);
+	void verify_captcha(uWS::WebSocket<uWS::SERVER>, const std::string& token);
 
 	void writefiles();
 	void readfiles();
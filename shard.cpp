@@ -0,0 +1,153 @@
+#include "server.hpp"
+
+#include <csignal>
+#include <pthread.h>
+
+/* Shard class functions */
+
+Shard::Shard(Server * const srv, const uint32_t index)
+	: srv(srv),
+	  hub(nullptr),
+	  group(nullptr),
+	  tasks(nullptr),
+	  timers(nullptr),
+	  index(index) {
+	if (index == 0) {
+		hub = &srv->h;
+		group = &hub->getDefaultGroup<uWS::SERVER>();
+		group->setUserData(this);
+		tasks = new TaskBuffer(hub->getLoop());
+		timers = new TimerWheel(hub->getLoop(), SERVER_TIMER_TICK_MSEC);
+		tid = std::this_thread::get_id();
+		limiter::use_loop(hub->getLoop());
+		return;
+	}
+	std::mutex m;
+	std::condition_variable cv;
+	bool ready = false;
+	thread = std::thread([this, &m, &cv, &ready] {
+		loop_thread(m, cv, ready);
+	});
+	std::unique_lock<std::mutex> lck(m);
+	cv.wait(lck, [&ready] { return ready; });
+}
+
+Shard::~Shard() {
+	if (index == 0) {
+		delete timers;
+		delete tasks;
+	}
+	/* The other loops are never deleted, see loop_thread */
+}
+
+void Shard::loop_thread(std::mutex& m, std::condition_variable& cv, bool& ready) {
+	/* Signals are handled by the main loop */
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+	/* The hub has to be created here, its group takes the thread id from it */
+	hub = new uWS::Hub(uWS::NO_DELAY, false);
+	group = &hub->getDefaultGroup<uWS::SERVER>();
+	group->setUserData(this);
+	group->addAsync();
+	group->onMessage(srv->msghandler);
+	group->onDisconnection(srv->dischandler);
+	tasks = new TaskBuffer(hub->getLoop());
+	timers = new TimerWheel(hub->getLoop(), SERVER_TIMER_TICK_MSEC);
+	tid = std::this_thread::get_id();
+	limiter::use_loop(hub->getLoop());
+	{
+		std::lock_guard<std::mutex> lck(m);
+		ready = true;
+	}
+	cv.notify_one();
+
+	hub->run();
+
+	std::vector<World *> owned;
+	{
+		std::lock_guard<std::mutex> lck(srv->worldlock);
+		for (auto it = srv->worlds.begin(); it != srv->worlds.end();) {
+			if (it->second->shard == this) {
+				owned.push_back(it->second);
+				it = srv->worlds.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+	for (World * const w : owned) {
+		delete w;
+	}
+	/* The hub, the task buffer and the timers are left to the process exit,
+	 * the loop can't be deleted while the sockets are still closing */
+}
+
+bool Shard::is_current() const {
+	return std::this_thread::get_id() == tid;
+}
+
+void Shard::post(const std::function<void(void)>& fn) {
+	tasks->queueTask(fn);
+	tasks->runTasks();
+}
+
+void Shard::exec(const std::function<void(void)>& fn) {
+	if (is_current()) {
+		fn();
+	} else {
+		post(fn);
+	}
+}
+
+uWS::Group<uWS::SERVER> * Shard::get_group() const {
+	return group;
+}
+
+uv_loop_t * Shard::get_loop() const {
+	return hub->getLoop();
+}
+
+TaskBuffer * Shard::get_tasks() const {
+	return tasks;
+}
+
+TimerWheel * Shard::get_timers() const {
+	return timers;
+}
+
+void Shard::adopt(uWS::WebSocket<uWS::SERVER> ws) {
+	uv_poll_t * const p = ws.getPollHandle();
+	uS::Socket s(p);
+	((uWS::Group<uWS::SERVER> *)s.getSocketData()->nodeData)->removeWebSocket(p);
+	s.transfer((uS::NodeData *)group, &Shard::adopted);
+}
+
+void Shard::adopted(uv_poll_t * const p) {
+	uS::Socket s(p);
+	uS::SocketData * const sd = s.getSocketData();
+	uWS::Group<uWS::SERVER> * const group = (uWS::Group<uWS::SERVER> *)sd->nodeData;
+	/* Still linked to the sockets of the old group */
+	sd->next = sd->prev = nullptr;
+	group->addWebSocket(p);
+	/* The old loop corked it while reading the join message */
+	s.cork(false);
+	Shard * const shard = (Shard *)group->getUserData();
+	uWS::WebSocket<uWS::SERVER> ws(p);
+	SocketInfo * const si = (SocketInfo *)ws.getUserData();
+	shard->srv->join_world(ws, si->joinworld, si->joinprotocol);
+}
+
+void Shard::stop() {
+	if (index == 0) {
+		return;
+	}
+	post([this] {
+		group->forEach([](uWS::WebSocket<uWS::SERVER> ws) {
+			ws.close();
+		});
+		uv_stop(hub->getLoop());
+	});
+	thread.join();
+}
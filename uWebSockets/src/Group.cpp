@@ -100,6 +100,11 @@ void Group<isServer>::stopListening() {
     }
 }
 
+template <bool isServer>
+void Group<isServer>::onAccept(std::function<bool (uS::Socket::Address)> handler) {
+    acceptHandler = handler;
+}
+
 template <bool isServer>
 void Group<isServer>::onConnection(std::function<void (WebSocket<isServer>, UpgradeInfo)> handler) {
     connectionHandler = handler;
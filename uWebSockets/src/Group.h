@@ -18,6 +18,7 @@ struct UpgradeInfo {
 template <bool isServer>
 struct WIN32_EXPORT Group : protected uS::NodeData {
     friend struct Hub;
+    std::function<bool(uS::Socket::Address)> acceptHandler;
     std::function<void(WebSocket<isServer>, UpgradeInfo)> connectionHandler;
     std::function<void(WebSocket<isServer>, char *message, size_t length, OpCode opCode)> messageHandler;
     std::function<void(WebSocket<isServer>, int code, char *message, size_t length)> disconnectionHandler;
@@ -50,6 +51,8 @@ protected:
     void stopListening();
 
 public:
+    // return false to close the socket before any of the HTTP upgrade is read
+    void onAccept(std::function<bool(uS::Socket::Address)> handler);
     void onConnection(std::function<void(WebSocket<isServer>, UpgradeInfo ui)> handler);
     void onMessage(std::function<void(WebSocket<isServer>, char *, size_t, OpCode)> handler);
     void onDisconnection(std::function<void(WebSocket<isServer>, int code, char *message, size_t length)> handler);
@@ -44,6 +44,12 @@ char *Hub::inflate(char *data, size_t &length) {
 
 void Hub::onServerAccept(uS::Socket s) {
     uS::SocketData *socketData = s.getSocketData();
+    Group<SERVER> *group = (Group<SERVER> *) socketData->nodeData;
+    if (group->acceptHandler && !group->acceptHandler(s.getAddress())) {
+        s.close();
+        delete socketData;
+        return;
+    }
     s.startTimeout<HTTPSocket<SERVER>::onEnd>();
     s.enterState<HTTPSocket<SERVER>>(new HTTPSocket<SERVER>::Data(socketData));
     delete socketData;
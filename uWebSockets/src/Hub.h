@@ -55,6 +55,7 @@ struct WIN32_EXPORT Hub : private uS::Node, public Group<SERVER>, public Group<C
 
     using uS::Node::run;
     using uS::Node::getLoop;
+    using Group<SERVER>::onAccept;
     using Group<SERVER>::onConnection;
     using Group<CLIENT>::onConnection;
     using Group<SERVER>::onMessage;
@@ -1,23 +1,54 @@
 #include "server.hpp"
 
+#include <algorithm>
+
+/* Chunk read by a disk worker */
+struct loadedchunk_t {
+	bool found;
+	char data[16 * 16 * 3];
+};
+
 /* Chunk class functions */
 
+std::atomic<uint64_t> Chunk::msgcache_hits(0);
+std::atomic<uint64_t> Chunk::msgcache_misses(0);
+
 Chunk::Chunk(const int32_t cx, const int32_t cy, const uint32_t bgclr, Database * const db)
 	: db(db),
 	  bgclr(bgclr),
 	  cx(cx),
 	  cy(cy),
-	  changed(false),
-	  ranked(db->getChunkProtection(cx, cy)) {
+	  version(0),
+	  savedversion(0),
+	  stagedversion(0),
+	  dirtysince(0),
+	  ranked(db->getChunkProtection(cx, cy)),
+	  prepd(nullptr) {
 	if(!db->get_chunk(cx, cy, (char *)&data)){
-		for (size_t i = 0; i < sizeof(data); i++) {
-			data[i] = (uint8_t) (bgclr >> ((i % 3) * 8));
-		}
-		//memset(data, 255, sizeof(data)); // infra req: change color
+		fill_bg();
+	}
+}
+
+Chunk::Chunk(const int32_t cx, const int32_t cy, const uint32_t bgclr, Database * const db, char const * const loaded)
+	: db(db),
+	  bgclr(bgclr),
+	  cx(cx),
+	  cy(cy),
+	  version(0),
+	  savedversion(0),
+	  stagedversion(0),
+	  dirtysince(0),
+	  ranked(db->getChunkProtection(cx, cy)),
+	  prepd(nullptr) {
+	if(loaded){
+		memcpy(data, loaded, sizeof(data));
+	} else {
+		fill_bg();
 	}
 }
 
 Chunk::~Chunk() {
+	invalidate_msg();
 	save();
 }
 
@@ -29,10 +60,18 @@ bool Chunk::set_data(const uint8_t x, const uint8_t y, const RGB clr) {
 	data[pos] = clr.r;
 	data[pos + 1] = clr.g;
 	data[pos + 2] = clr.b;
-	changed = true;
+	++version;
+	invalidate_msg();
 	return true;
 }
 
+void Chunk::set_ranked(const bool state) {
+	if(ranked != state){
+		ranked = state;
+		invalidate_msg();
+	}
+}
+
 size_t Chunk::compress_data_to(uint8_t (&msg)[16 * 16 * 3 + 10 + 4]) {
 	const uint16_t s = 16 * 16 * 3;
 	struct compressedPoint {
@@ -101,17 +140,28 @@ size_t Chunk::compress_data_to(uint8_t (&msg)[16 * 16 * 3 + 10 + 4]) {
 }
 
 uWS::WebSocket<uWS::SERVER>::PreparedMessage * Chunk::get_prepd_data_msg() {
+	if(prepd){
+		++msgcache_hits;
+		return prepd;
+	}
+	++msgcache_misses;
 	uint8_t msg[16 * 16 * 3 + 10 + 4];
 	size_t size = compress_data_to(msg);
-	uWS::WebSocket<uWS::SERVER>::PreparedMessage * prep = uWS::WebSocket<uWS::SERVER>::prepareMessage(
+	prepd = uWS::WebSocket<uWS::SERVER>::prepareMessage(
 			(char *) &msg[0], size, uWS::BINARY, false);
-	return prep;
+	return prepd;
+}
+
+void Chunk::invalidate_msg() {
+	if(prepd){
+		/* Sockets still sending it hold their own reference */
+		uWS::WebSocket<uWS::SERVER>::finalizeMessage(prepd);
+		prepd = nullptr;
+	}
 }
 
 void Chunk::send_data(uWS::WebSocket<uWS::SERVER> ws, bool compressed) {
-	uint8_t msg[16 * 16 * 3 + 10 + 4];
-	size_t size = compress_data_to(msg);
-	ws.send((const char *)&msg[0], size, uWS::BINARY);
+	ws.sendPrepared(get_prepd_data_msg());
 }
 
 uint8_t * Chunk::get_data() {
@@ -120,40 +170,112 @@ uint8_t * Chunk::get_data() {
 
 void Chunk::set_data(char const * const newdata, size_t size) {
 	memcpy(data, newdata, size);
-	changed = true;
+	++version;
+	invalidate_msg();
 }
 
 void Chunk::save() {
-	if(changed){
-		changed = false;
-		db->set_chunk(cx, cy, (char *)&data);
+	if(version != savedversion && db->set_chunk(cx, cy, (char *)&data)){
+		savedversion = stagedversion = version;
+		dirtysince = 0;
 		/* std::cout << "Chunk saved at X: " << cx << ", Y: " << cy << std::endl; */
 	}
 }
 
+bool Chunk::mark_dirty(const uint64_t now) {
+	if(dirtysince){
+		return false;
+	}
+	/* 0 means clean */
+	dirtysince = now ? now : 1;
+	return true;
+}
+
+uint64_t Chunk::get_dirtysince() const {
+	return dirtysince;
+}
+
+bool Chunk::stage(snapshot_t& snap) {
+	const uint64_t since = dirtysince;
+	dirtysince = 0;
+	if(version == savedversion || version == stagedversion){
+		return false;
+	}
+	snap.entries.push_back({cx, cy, version, (uint32_t)snap.arena.size(), since, false});
+	snap.arena.insert(snap.arena.end(), (char *)data, (char *)data + sizeof(data));
+	if(since < snap.oldest){
+		snap.oldest = since;
+	}
+	stagedversion = version;
+	return true;
+}
+
+void Chunk::staged_written(const uint32_t v, const bool saved) {
+	if(saved){
+		/* Unless it was saved again since */
+		if((int32_t)(v - savedversion) > 0){
+			savedversion = v;
+		}
+	} else if(stagedversion == v){
+		/* Goes in the next snapshot */
+		stagedversion = savedversion;
+	}
+}
+
+bool Chunk::is_staged() const {
+	return stagedversion != savedversion;
+}
+
 void Chunk::clear(){
+	fill_bg();
+	++version;
+	invalidate_msg();
+}
+
+void Chunk::fill_bg(){
 	for (size_t i = 0; i < sizeof(data); i++) {
 		data[i] = (uint8_t) (bgclr >> ((i % 3) * 8));
 	}
-	changed = true;
+	//memset(data, 255, sizeof(data)); // infra req: change color
 }
 
 /* World class functions */
 
-World::World(const std::string& path, const std::string& name)
+std::atomic<uint64_t> World::chunks_saved(0);
+std::atomic<uint64_t> World::save_latency_total(0);
+std::atomic<uint64_t> World::save_latency_max(0);
+std::atomic<int64_t> World::chunks_queued(0);
+
+World::World(const std::string& path, const std::string& name, Shard * const shard, WorkerPool * const diskpool, WorkerPool * const savepool, RegionCache * const regions)
 	: bgclr(0xFFFFFF),
 	  pids(0),
 	  paintrate(32),
 	  defaultRank(Client::USER),
-	  db(path + name + "/"),
+	  db(path + name + "/", regions),
+	  diskpool(diskpool),
+	  savepool(savepool),
+	  unloading(false),
+	  logflushing(false),
+	  snapshots(0),
+	  logstart(uv_now(shard->get_loop())),
+	  logged(false),
+	  cptimer(&World::checkpoint_timeout, this),
+	  logtimer(&World::log_timeout, this),
 	  pass(),
-	  name(name) {
-	uv_timer_init(uv_default_loop(), &upd_hdl);
+	  plstart(0),
+	  ticks(0),
+	  online(0),
+	  name(name),
+	  shard(shard) {
+	uv_timer_init(shard->get_loop(), &upd_hdl);
 	upd_hdl.data = this;
 	reload();
 }
 
 World::~World() {
+	/* On exit, snapshots could still be writing */
+	db.wait_writes();
+	chunks_queued -= dirtyqueue.size();
 	for(const auto& chunk : chunks){
 		delete chunk.second;
 	}
@@ -186,7 +308,7 @@ void World::reload() {
 
 void World::update_all_clients() {
 	for (auto cli : clients) {
-		plupdates.emplace(cli);
+		upd_cli(cli);
 	}
 }
 
@@ -227,41 +349,150 @@ void World::add_cli(Client * const cl) {
 		cl->promote(Client::NONE, paintrate);
 	}
 	clients.emplace(cl);
+	clientsbyid[cl->id] = cl;
+	clientsbynick.emplace(cl->get_nick(), cl);
+	clientsbyip[cl->si->ip].push_back(cl);
+	clientsbyrank[rank_index(cl->get_rank())].insert(cl);
+	online = clients.size();
+	uint32_t slot;
+	if (freeslots.size()) {
+		slot = freeslots.back();
+		freeslots.pop_back();
+	} else {
+		slot = plclient.size();
+		plclient.resize(slot + 1);
+		plx.resize(slot + 1);
+		ply.resize(slot + 1);
+		plclr.resize(slot + 1);
+		pltool.resize(slot + 1);
+		plcell.resize(slot + 1);
+		plcellpos.resize(slot + 1);
+		pldirty.resize((slot >> 6) + 1);
+		plfardirty.resize((slot >> 6) + 1);
+	}
+	cl->slot = slot;
+	plclient[slot] = cl;
+	plx[slot] = 0;
+	ply[slot] = 0;
+	plclr[slot] = {0, 0, 0};
+	pltool[slot] = 0;
+	plcell[slot] = player_cell(0, 0);
+	grid_add(slot);
 	update_all_clients();
 	sched_updates();
 }
 
 void World::upd_cli(Client * const cl) {
-	plupdates.emplace(cl);
+	pldirty[cl->slot >> 6] |= 1ull << (cl->slot & 63);
 	sched_updates();
 }
 
+void World::move_cli(Client * const cl, const pinfo_t& pos) {
+	const uint32_t slot = cl->slot;
+	plx[slot] = pos.x;
+	ply[slot] = pos.y;
+	plclr[slot] = {pos.r, pos.g, pos.b};
+	pltool[slot] = pos.tool;
+	const uint64_t cell = player_cell(pos.x, pos.y);
+	if(cell != plcell[slot]){
+		grid_rm(slot);
+		plcell[slot] = cell;
+		grid_add(slot);
+	}
+	upd_cli(cl);
+}
+
+pinfo_t World::get_pos(const uint32_t slot) const {
+	return {plx[slot], ply[slot], plclr[slot].r, plclr[slot].g, plclr[slot].b, pltool[slot]};
+}
+
+void World::grid_add(const uint32_t slot) {
+	std::vector<uint32_t> & cell = grid[plcell[slot]];
+	plcellpos[slot] = cell.size();
+	cell.push_back(slot);
+}
+
+void World::grid_rm(const uint32_t slot) {
+	const auto search = grid.find(plcell[slot]);
+	std::vector<uint32_t> & cell = search->second;
+	const uint32_t last = cell.back();
+	cell[plcellpos[slot]] = last;
+	plcellpos[last] = plcellpos[slot];
+	cell.pop_back();
+	if(cell.empty()){
+		grid.erase(search);
+	}
+}
+
 void World::rm_cli(Client * const cl) {
-	plleft.emplace(cl->id);
+	const uint32_t slot = cl->slot;
+	plleft.push_back(cl->id);
 	clients.erase(cl);
-	plupdates.erase(cl);
+	clientsbyid.erase(cl->id);
+	/* Only removes it, since it's not in clientsbyid anymore */
+	nick_changed(cl, cl->get_nick());
+	const auto byip = clientsbyip.find(cl->si->ip);
+	if (byip != clientsbyip.end()) {
+		std::vector<Client *> & same = byip->second;
+		same.erase(std::find(same.begin(), same.end(), cl));
+		if (same.empty()) {
+			clientsbyip.erase(byip);
+		}
+	}
+	clientsbyrank[rank_index(cl->get_rank())].erase(cl);
+	online = clients.size();
+	grid_rm(slot);
+	pldirty[slot >> 6] &= ~(1ull << (slot & 63));
+	plfardirty[slot >> 6] &= ~(1ull << (slot & 63));
+	plclient[slot] = nullptr;
+	freeslots.push_back(slot);
 	if(!clients.size()){
 		return;
 	}
 	sched_updates();
 }
 
+uint8_t World::rank_index(const uint8_t rank) {
+	return rank > Client::ADMIN ? Client::ADMIN : rank;
+}
+
 Client * World::get_cli(const uint32_t id) const {
-	for(const auto client : clients){
-		if(id == client->id){
-			return client;
-		}
-	}
-	return nullptr;
+	const auto search = clientsbyid.find(id);
+	return search != clientsbyid.end() ? search->second : nullptr;
 }
 
 Client * World::get_cli(const std::string name) const {
-	for(const auto client : clients){
-		if(name == client->get_nick()){
-			return client;
+	const auto search = clientsbynick.find(name);
+	return search != clientsbynick.end() ? search->second : nullptr;
+}
+
+std::vector<Client *> World::get_clis(const std::string& ip) const {
+	const auto search = clientsbyip.find(ip);
+	return search != clientsbyip.end() ? search->second : std::vector<Client *>();
+}
+
+const std::unordered_set<Client *> & World::get_clis(const uint8_t rank) const {
+	return clientsbyrank[rank_index(rank)];
+}
+
+void World::rank_changed(Client * const cl, const uint8_t oldrank) {
+	/* Not indexed yet if it's promoted before joining */
+	if (clientsbyrank[rank_index(oldrank)].erase(cl)) {
+		clientsbyrank[rank_index(cl->get_rank())].insert(cl);
+	}
+}
+
+void World::nick_changed(Client * const cl, const std::string& oldnick) {
+	const auto range = clientsbynick.equal_range(oldnick);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == cl) {
+			clientsbynick.erase(it);
+			break;
 		}
 	}
-	return nullptr;
+	if (clientsbyid.count(cl->id)) {
+		clientsbynick.emplace(cl->get_nick(), cl);
+	}
 }
 
 void World::sched_updates() {
@@ -270,121 +501,419 @@ void World::sched_updates() {
 	}
 }
 
+uint64_t World::player_cell(const int32_t x, const int32_t y) {
+	return key64(x >> (4 + WORLD_PLAYER_CELL_SHIFT), y >> (4 + WORLD_PLAYER_CELL_SHIFT));
+}
+
+/* Calls fn with every set bit, starting at 'start' and wrapping around */
+template<typename F>
+static void for_each_bit(const std::vector<uint64_t>& bits, const uint32_t start, F fn) {
+	const size_t words = bits.size();
+	if (!words) {
+		return;
+	}
+	const uint64_t startmask = ~0ull << (start & 63);
+	size_t w = (start >> 6) % words;
+	uint64_t word = bits[w] & startmask;
+	for (size_t n = 0; n <= words; n++) {
+		while (word) {
+			fn((uint32_t)(w << 6 | __builtin_ctzll(word)));
+			word &= word - 1;
+		}
+		w = (w + 1) % words;
+		word = n + 1 == words ? bits[w] & ~startmask : bits[w];
+	}
+}
+
+static bool mover_cmp(const mover_t& a, const mover_t& b) {
+	return a.cell < b.cell || (a.cell == b.cell && a.order < b.order);
+}
+
 void World::send_updates(uv_timer_t * const t) {
 	World * const wrld = (World *) t->data;
-	size_t offs = 2;
-	uint32_t tmp;
-	uint8_t * const upd = (uint8_t *) malloc(1 + 1 + wrld->plupdates.size() * (sizeof(uint32_t) + sizeof(pinfo_t))
-	                                   + sizeof(uint16_t) + wrld->pxupdates.size() * sizeof(pixupd_t)
-	                                   + 1 + sizeof(uint32_t) * wrld->plleft.size());
-	upd[0] = UPDATE;
-	
+	tickarena_t & a = wrld->arena;
 	bool pendingUpdates = false;
+	const bool fartick = ++wrld->ticks % WORLD_FAR_PLAYER_UPDATE_DIVISOR == 0;
 	
-	tmp = 0;
-	for (auto it = wrld->plupdates.begin();;) {
-		if (it == wrld->plupdates.end()) {
-			wrld->plupdates.clear();
-			break;
+	/* Players that left are the same for everyone */
+	uint32_t nleft = wrld->plleft.size();
+	if (nleft > WORLD_MAX_PLAYER_LEFT_UPDATES) {
+		nleft = WORLD_MAX_PLAYER_LEFT_UPDATES;
+		pendingUpdates = true;
+	}
+	
+	/* Players that moved by cell, starting with the ones that didn't fit last time */
+	a.moved.clear();
+	a.movers.clear();
+	for_each_bit(wrld->pldirty, wrld->plstart, [&](const uint32_t slot) {
+		a.movers.push_back({wrld->plcell[slot], (uint32_t)a.moved.size(), slot});
+		a.moved.push_back(slot);
+	});
+	std::sort(a.movers.begin(), a.movers.end(), mover_cmp);
+	a.resend.assign(a.moved.size(), 0);
+	a.far.clear();
+	if (fartick) {
+		for_each_bit(wrld->plfardirty, 0, [&](const uint32_t slot) {
+			a.far.push_back({wrld->plcell[slot], (uint32_t)a.far.size(), slot});
+		});
+	}
+	a.farresend.assign(a.far.size(), 0);
+	
+	/* Changed pixels with their current color, oldest changes first. Chunks that don't fit wait. */
+	a.pixels.clear();
+	a.pxchunks.clear();
+	a.resends.clear();
+	while (wrld->pxdirtyorder.size()) {
+		const uint64_t chunk = wrld->pxdirtyorder.front();
+		const auto dirty = wrld->pxdirty.find(chunk);
+		if (dirty == wrld->pxdirty.end()) {
+			/* Already sent whole by del_chunk or paste_chunk */
+			wrld->pxdirtyorder.pop_front();
+			continue;
 		}
-		if(tmp >= WORLD_MAX_PLAYER_UPDATES){
-			wrld->plupdates.erase(wrld->plupdates.begin(), it);
-			pendingUpdates = true;
-			break;
+		const uint32_t count = dirty->second.count();
+		if (count >= WORLD_CHUNK_RESEND_PIXELS) {
+			if (a.resends.size() >= WORLD_MAX_CHUNK_RESENDS) {
+				pendingUpdates = true;
+				break;
+			}
+			a.resends.push_back(chunk);
+		} else {
+			if (a.pixels.size() + count > WORLD_MAX_PIXEL_UPDATES) {
+				pendingUpdates = true;
+				break;
+			}
+			const int32_t cx = (int32_t)(uint32_t)chunk;
+			const int32_t cy = (int32_t)(chunk >> 32);
+			Chunk * const c = wrld->get_chunk(cx, cy);
+			if (c) {
+				const uint8_t * const data = c->get_data();
+				a.pxchunks.push_back({chunk, (uint32_t)a.pixels.size(), count});
+				for (uint32_t i = 0; i < 256; i++) {
+					if (dirty->second[i]) {
+						const uint8_t * const clr = &data[i * 3];
+						a.pixels.push_back({cx * 16 + (int32_t)(i & 0xF), cy * 16 + (int32_t)(i >> 4), clr[0], clr[1], clr[2]});
+					}
+				}
+			}
 		}
-		auto client = *it;
-		memcpy((void *)(upd + offs), (void *)&client->id, sizeof(uint32_t));
-		offs += sizeof(uint32_t);
-		memcpy((void *)(upd + offs), (void *)client->get_pos(), sizeof(pinfo_t));
-		offs += sizeof(pinfo_t);
-		++it;
-		++tmp;
-	}
-	upd[1] = tmp;
-	tmp = wrld->pxupdates.size();
-	tmp = tmp >= WORLD_MAX_PIXEL_UPDATES ? WORLD_MAX_PIXEL_UPDATES : tmp;
-	memcpy((void *)(upd + offs), &tmp, sizeof(uint16_t));
-	tmp = 0;
-	offs += sizeof(uint16_t);
-	for(auto& px : wrld->pxupdates){
-		memcpy((void *)(upd + offs), &px, sizeof(pixupd_t));
-		offs += sizeof(pixupd_t);
-		if(++tmp >= WORLD_MAX_PIXEL_UPDATES){
-			break;
+		wrld->pxdirty.erase(dirty);
+		wrld->pxdirtyorder.pop_front();
+	}
+	std::sort(a.pxchunks.begin(), a.pxchunks.end(), [](const pxchunk_t& x, const pxchunk_t& y) {
+		return x.chunk < y.chunk;
+	});
+	a.dirtychunks.clear();
+	for (const pxchunk_t & c : a.pxchunks) {
+		a.dirtychunks.push_back(c.chunk);
+	}
+	/* Mostly changed chunks, their cached CHUNKDATA is smaller than the pixel updates */
+	for (const uint64_t chunk : a.resends) {
+		Chunk * const c = wrld->get_chunk((int32_t)(uint32_t)chunk, (int32_t)(chunk >> 32));
+		if (!c) {
+			continue;
+		}
+		uWS::WebSocket<uWS::SERVER>::PreparedMessage * const prep = c->get_prepd_data_msg();
+		for (const auto client : wrld->clients) {
+			if (client->is_subscribed(chunk)) {
+				client->get_ws().sendPrepared(prep);
+			}
 		}
 	}
-	wrld->pxupdates.clear();
 	
-	tmp = wrld->plleft.size();
-	tmp = tmp >= WORLD_MAX_PLAYER_LEFT_UPDATES ? WORLD_MAX_PLAYER_LEFT_UPDATES : tmp;
-	memcpy((void *)(upd + offs), &tmp, sizeof(uint8_t));
-	tmp = 0;
-	offs += sizeof(uint8_t);
-	for (auto it = wrld->plleft.begin();;) {
-		if (it == wrld->plleft.end()) {
-			wrld->plleft.clear();
-			break;
+	/* Clients in the same cell that get the same chunks share one frame */
+	a.frames.clear();
+	a.framekeys.clear();
+	size_t tablesize = 16;
+	while (tablesize < wrld->clients.size() * 2) {
+		tablesize <<= 1;
+	}
+	a.frametable.assign(tablesize, UINT32_MAX);
+	for (const auto & cell : wrld->grid) {
+		const int32_t cx = (int32_t)(uint32_t)cell.first;
+		const int32_t cy = (int32_t)(cell.first >> 32);
+		/* Cursors nearby first, oldest updates first */
+		a.near.clear();
+		for (int32_t dy = -1; dy <= 1; dy++) {
+			for (int32_t dx = -1; dx <= 1; dx++) {
+				const mover_t key = {key64(cx + dx, cy + dy), 0, 0};
+				for (auto it = std::lower_bound(a.movers.begin(), a.movers.end(), key, mover_cmp);
+				     it != a.movers.end() && it->cell == key.cell; ++it) {
+					a.near.push_back(it->order);
+				}
+			}
 		}
-		if(tmp >= WORLD_MAX_PLAYER_LEFT_UPDATES){
-			wrld->plleft.erase(wrld->plleft.begin(), it);
-			pendingUpdates = true;
-			break;
+		std::sort(a.near.begin(), a.near.end());
+		a.players.clear();
+		for (const uint32_t i : a.near) {
+			if (a.players.size() >= WORLD_MAX_PLAYER_UPDATES) {
+				a.resend[i] = 1;
+				pendingUpdates = true;
+			} else {
+				a.players.push_back(a.moved[i]);
+			}
+		}
+		for (const mover_t & pl : a.far) {
+			const int32_t ox = (int32_t)(uint32_t)pl.cell - cx;
+			const int32_t oy = (int32_t)(pl.cell >> 32) - cy;
+			if (ox >= -1 && ox <= 1 && oy >= -1 && oy <= 1) {
+				continue;
+			}
+			if (a.players.size() >= WORLD_MAX_PLAYER_UPDATES) {
+				a.farresend[pl.order] = 1;
+			} else {
+				a.players.push_back(pl.slot);
+			}
+		}
+		
+		for (const uint32_t slot : cell.second) {
+			Client * const client = wrld->plclient[slot];
+			a.subscribed.clear();
+			const std::list<uint64_t> & subs = client->get_subscriptions();
+			if (subs.size() < a.dirtychunks.size()) {
+				for (const uint64_t chunk : subs) {
+					const auto search = std::lower_bound(a.dirtychunks.begin(), a.dirtychunks.end(), chunk);
+					if (search != a.dirtychunks.end() && *search == chunk) {
+						a.subscribed.push_back(search - a.dirtychunks.begin());
+					}
+				}
+				std::sort(a.subscribed.begin(), a.subscribed.end());
+			} else {
+				for (uint16_t i = 0; i < a.dirtychunks.size(); i++) {
+					if (client->is_subscribed(a.dirtychunks[i])) {
+						a.subscribed.push_back(i);
+					}
+				}
+			}
+			/* Frames without players are the same for every cell */
+			const bool hascell = a.players.size() != 0;
+			const bool compact = client->get_protocol() == PROTO_COMPACT_UPDATES;
+			uint64_t hash = hascell ? 0xCBF29CE484222325ull ^ cell.first : 0xCBF29CE484222325ull;
+			hash ^= compact;
+			for (const uint16_t i : a.subscribed) {
+				hash = (hash ^ i) * 0x100000001B3ull;
+			}
+			size_t probe = hash & (tablesize - 1);
+			frameent_t * frame = nullptr;
+			while (a.frametable[probe] != UINT32_MAX) {
+				frameent_t & f = a.frames[a.frametable[probe]];
+				if (f.hash == hash && f.hascell == hascell && (!hascell || f.cell == cell.first) && f.compact == compact
+				    && f.keylen == a.subscribed.size()
+				    && std::equal(a.subscribed.begin(), a.subscribed.end(), a.framekeys.begin() + f.keyoff)) {
+					frame = &f;
+					break;
+				}
+				probe = (probe + 1) & (tablesize - 1);
+			}
+			if (!frame) {
+				a.frametable[probe] = a.frames.size();
+				a.frames.push_back({hash, cell.first, (uint32_t)a.framekeys.size(),
+					(uint32_t)a.subscribed.size(), hascell, compact, nullptr});
+				a.framekeys.insert(a.framekeys.end(), a.subscribed.begin(), a.subscribed.end());
+				frame = &a.frames.back();
+				uint16_t count = 0;
+				for (const uint16_t i : a.subscribed) {
+					count += a.pxchunks[i].count;
+				}
+				if (!count && !a.players.size() && !nleft) {
+					/* Nothing for these clients this time */
+					continue;
+				}
+				const size_t pxsize = compact
+					? a.subscribed.size() * (sizeof(chunkpos_t) + 1) + count * (1 + sizeof(RGB))
+					: count * sizeof(pixupd_t);
+				a.buf.resize(2 + a.players.size() * (sizeof(uint32_t) + sizeof(pinfo_t))
+				             + sizeof(uint16_t) + pxsize + 1 + nleft * sizeof(uint32_t));
+				uint8_t * curr = a.buf.data();
+				*curr++ = UPDATE;
+				*curr++ = a.players.size();
+				for (const uint32_t pl : a.players) {
+					memcpy(curr, &wrld->plclient[pl]->id, sizeof(uint32_t));
+					curr += sizeof(uint32_t);
+					const pinfo_t pos = wrld->get_pos(pl);
+					memcpy(curr, &pos, sizeof(pinfo_t));
+					curr += sizeof(pinfo_t);
+				}
+				if (compact) {
+					/* Chunk count, then for each chunk its position, pixel count - 1
+					 * and the pixels as (y << 4 | x) followed by RGB */
+					const uint16_t chunkcount = a.subscribed.size();
+					memcpy(curr, &chunkcount, sizeof(uint16_t));
+					curr += sizeof(uint16_t);
+					for (const uint16_t i : a.subscribed) {
+						const pxchunk_t & c = a.pxchunks[i];
+						const chunkpos_t chunkpos = {(int32_t)(uint32_t)c.chunk, (int32_t)(c.chunk >> 32)};
+						memcpy(curr, &chunkpos, sizeof(chunkpos_t));
+						curr += sizeof(chunkpos_t);
+						*curr++ = c.count - 1;
+						for (uint32_t px = c.start; px < c.start + c.count; px++) {
+							const pixupd_t & upd = a.pixels[px];
+							*curr++ = (upd.y & 0xF) << 4 | (upd.x & 0xF);
+							*curr++ = upd.r;
+							*curr++ = upd.g;
+							*curr++ = upd.b;
+						}
+					}
+				} else {
+					memcpy(curr, &count, sizeof(uint16_t));
+					curr += sizeof(uint16_t);
+					for (const uint16_t i : a.subscribed) {
+						memcpy(curr, &a.pixels[a.pxchunks[i].start], a.pxchunks[i].count * sizeof(pixupd_t));
+						curr += a.pxchunks[i].count * sizeof(pixupd_t);
+					}
+				}
+				*curr++ = nleft;
+				memcpy(curr, wrld->plleft.data(), nleft * sizeof(uint32_t));
+				frame->prep = uWS::WebSocket<uWS::SERVER>::prepareMessage(
+					(char *)a.buf.data(), a.buf.size(), uWS::BINARY, false);
+			}
+			if (frame->prep) {
+				client->get_ws().sendPrepared(frame->prep);
+			}
+		}
+	}
+	for (const frameent_t & frame : a.frames) {
+		if (frame.prep) {
+			uWS::WebSocket<uWS::SERVER>::finalizeMessage(frame.prep);
 		}
-		uint32_t pl = *it;
-		memcpy((void *)(upd + offs), &pl, sizeof(uint32_t));
-		offs += sizeof(uint32_t);
-		++tmp;
-		++it;
 	}
+	wrld->plleft.erase(wrld->plleft.begin(), wrld->plleft.begin() + nleft);
 	
-	uWS::WebSocket<uWS::SERVER>::PreparedMessage * prep = uWS::WebSocket<uWS::SERVER>::prepareMessage(
-		(char *)upd, offs, uWS::BINARY, false);
-	for(auto client : wrld->clients){
-		client->get_ws().sendPrepared(prep);
+	/* Far viewers that didn't fit get them on the next far update */
+	for (const mover_t & pl : a.far) {
+		if (!a.farresend[pl.order]) {
+			wrld->plfardirty[pl.slot >> 6] &= ~(1ull << (pl.slot & 63));
+		}
 	}
-	uWS::WebSocket<uWS::SERVER>::finalizeMessage(prep);
-	free(upd);
-	if (pendingUpdates) {
+	/* Moved players that didn't fit somewhere go first next time */
+	bool first = true;
+	for (uint32_t i = 0; i < a.moved.size(); i++) {
+		const uint32_t slot = a.moved[i];
+		wrld->plfardirty[slot >> 6] |= 1ull << (slot & 63);
+		if (!a.resend[i]) {
+			wrld->pldirty[slot >> 6] &= ~(1ull << (slot & 63));
+		} else if (first) {
+			wrld->plstart = slot;
+			first = false;
+		}
+	}
+	
+	if (pendingUpdates || !std::all_of(wrld->plfardirty.begin(), wrld->plfardirty.end(),
+	                                   [](const uint64_t w) { return !w; })) {
 		wrld->sched_updates();
 	}
 }
 
+bool World::is_valid_chunk(const int32_t x, const int32_t y) {
+	return !(x > WORLD_MAX_CHUNK_XY || y > WORLD_MAX_CHUNK_XY
+	  || x < ~WORLD_MAX_CHUNK_XY || y < ~WORLD_MAX_CHUNK_XY);
+}
+
+Chunk * World::add_chunk(const std::string& k, Chunk * const chunk) {
+	if(chunks.size() > WORLD_MAX_CHUNKS_LOADED){
+		/* Chunks being written by a snapshot stay, it could write their old data over a newer save */
+		for(auto it = chunks.begin(); it != chunks.end(); ++it){
+			if(!it->second->is_staged()){
+				delete it->second;
+				chunks.erase(it);
+				break;
+			}
+		}
+	}
+	return chunks[k] = chunk;
+}
+
 Chunk * World::get_chunk(const int32_t x, const int32_t y, bool create) {
-	if(x > WORLD_MAX_CHUNK_XY || y > WORLD_MAX_CHUNK_XY
-	  || x < ~WORLD_MAX_CHUNK_XY || y < ~WORLD_MAX_CHUNK_XY){
+	if(!is_valid_chunk(x, y)){
 		return nullptr;
 	}
-	Chunk * chunk = nullptr;
-	const auto search = chunks.find(key(x, y));
-	if(search == chunks.end()){
-		if(chunks.size() > WORLD_MAX_CHUNKS_LOADED){
-			auto it = chunks.begin();
-			/* expensive, need to figure out another way of limiting loaded chunks? */
-			for(auto it2 = chunks.begin(); ++it2 != chunks.end(); ++it);
-			delete it->second;
-			chunks.erase(it);
-		}
-		chunk = chunks[key(x, y)] = new Chunk(x, y, bgclr, &db);
-	} else {
-		chunk = search->second;
+	const std::string k(key(x, y));
+	const auto search = chunks.find(k);
+	if(search != chunks.end()){
+		return search->second;
 	}
-	return chunk;
+	const auto pending = pendingloads.find(k);
+	if(pending != pendingloads.end()){
+		/* Can't wait for it, the data read by the worker might become outdated */
+		pending->second.stale = true;
+	}
+	return add_chunk(k, new Chunk(x, y, bgclr, &db));
 }
 
-void World::send_chunk(uWS::WebSocket<uWS::SERVER> ws, const int32_t x, const int32_t y, bool compressed) {
-	Chunk * const c = get_chunk(x, y);
-	if(c){ c->send_data(ws, compressed); }
+void World::send_chunk(Client const * const cl, const int32_t x, const int32_t y, bool compressed) {
+	if(!is_valid_chunk(x, y)){
+		return;
+	}
+	const std::string k(key(x, y));
+	const auto search = chunks.find(k);
+	if(search != chunks.end()){
+		search->second->send_data(cl->get_ws(), compressed);
+		return;
+	}
+	const auto pending = pendingloads.find(k);
+	if(pending != pendingloads.end()){
+		/* Already being read, send it to this client too when it's done */
+		pending->second.waiting.push_back(cl->id);
+		return;
+	}
+	pendingloads[k] = {{cl->id}, false};
+	load_chunk(x, y);
+}
+
+void World::load_chunk(const int32_t x, const int32_t y) {
+	std::shared_ptr<loadedchunk_t> loaded(std::make_shared<loadedchunk_t>());
+	Database * const dbp = &db;
+	diskpool->queueJob([dbp, x, y, loaded] {
+		loaded->found = dbp->get_chunk(x, y, loaded->data);
+	}, [this, x, y, loaded] {
+		chunk_loaded(x, y, loaded->found ? loaded->data : nullptr);
+	}, shard->get_tasks());
+}
+
+void World::chunk_loaded(const int32_t x, const int32_t y, char const * const data) {
+	const std::string k(key(x, y));
+	const auto pending = pendingloads.find(k);
+	if(pending == pendingloads.end()){
+		return;
+	}
+	const pendingload_t load(std::move(pending->second));
+	pendingloads.erase(pending);
+	if(unloading){
+		try_close();
+		return;
+	}
+	Chunk * chunk = nullptr;
+	const auto search = chunks.find(k);
+	if(search != chunks.end()){
+		chunk = search->second;
+	} else if(load.stale){
+		chunk = get_chunk(x, y);
+	} else {
+		chunk = add_chunk(k, new Chunk(x, y, bgclr, &db, data));
+	}
+	for(const uint32_t id : load.waiting){
+		Client * const cl = get_cli(id);
+		if(cl){
+			chunk->send_data(cl->get_ws());
+		}
+	}
 }
 
 void World::del_chunk(const int32_t x, const int32_t y){
 	Chunk * const c = get_chunk(x, y);
 	if(c){
 		c->clear();
-		uWS::WebSocket<uWS::SERVER>::PreparedMessage * prep = c->get_prepd_data_msg();
+		db.log_chunk(x, y, (char *)c->get_data());
+		sched_log();
+		chunk_changed(c, x, y);
+		uWS::WebSocket<uWS::SERVER>::PreparedMessage * const prep = c->get_prepd_data_msg();
+		const uint64_t chunk = key64(x, y);
+		pxdirty.erase(chunk);
 		for(auto client : clients){
-			client->get_ws().sendPrepared(prep);
+			if(client->is_subscribed(chunk)){
+				client->get_ws().sendPrepared(prep);
+			}
 		}
-		uWS::WebSocket<uWS::SERVER>::finalizeMessage(prep);
 	}
 }
 
@@ -392,45 +921,119 @@ void World::paste_chunk(const int32_t x, const int32_t y, char const * const dat
 	Chunk * const c = get_chunk(x, y);
 	if(c){
 		c->set_data(data, 16 * 16 * 3);
+		db.log_chunk(x, y, data);
+		sched_log();
+		chunk_changed(c, x, y);
 
-		uWS::WebSocket<uWS::SERVER>::PreparedMessage * prep = c->get_prepd_data_msg();
+		uWS::WebSocket<uWS::SERVER>::PreparedMessage * const prep = c->get_prepd_data_msg();
+		const uint64_t chunk = key64(x, y);
+		pxdirty.erase(chunk);
 		for(auto client : clients){
-			client->get_ws().sendPrepared(prep);
+			if(client->is_subscribed(chunk)){
+				client->get_ws().sendPrepared(prep);
+			}
 		}
-		uWS::WebSocket<uWS::SERVER>::finalizeMessage(prep);
 	}
 }
 
 bool World::put_px(const int32_t x, const int32_t y, const RGB clr, uint8_t placerRank) {
 	Chunk * const chunk = get_chunk(x >> 4, y >> 4);
 	if(chunk && chunk->set_data(x & 0xF, y & 0xF, clr)){
-		pxupdates.push_back({x, y, clr.r, clr.g, clr.b});
+		db.log_px(x, y, clr.r, clr.g, clr.b);
+		sched_log();
+		chunk_changed(chunk, x >> 4, y >> 4);
+		const uint64_t k = key64(x >> 4, y >> 4);
+		std::bitset<256> & dirty = pxdirty[k];
+		if(dirty.none()){
+			pxdirtyorder.push_back(k);
+		}
+		dirty.set((y & 0xF) << 4 | (x & 0xF));
 		sched_updates();
 		return true;
 	}
 	return false;
 }
 
+void World::put_pxs(std::vector<pixupd_t>& pxs, uint8_t placerRank) {
+	/* One chunk lookup per chunk, the last pixel wins when the batch paints one twice */
+	std::stable_sort(pxs.begin(), pxs.end(), [](const pixupd_t& a, const pixupd_t& b) {
+		return key64(a.x >> 4, a.y >> 4) < key64(b.x >> 4, b.y >> 4);
+	});
+	bool changed = false;
+	for(size_t i = 0; i < pxs.size();){
+		const int32_t cx = pxs[i].x >> 4;
+		const int32_t cy = pxs[i].y >> 4;
+		size_t end = i + 1;
+		while(end < pxs.size() && pxs[end].x >> 4 == cx && pxs[end].y >> 4 == cy){
+			++end;
+		}
+		Chunk * const chunk = get_chunk(cx, cy);
+		std::bitset<256> * dirty = nullptr;
+		for(; chunk && i < end; i++){
+			const pixupd_t & px = pxs[i];
+			if(!chunk->set_data(px.x & 0xF, px.y & 0xF, {px.r, px.g, px.b})){
+				continue;
+			}
+			db.log_px(px.x, px.y, px.r, px.g, px.b);
+			if(!dirty){
+				chunk_changed(chunk, cx, cy);
+				const uint64_t k = key64(cx, cy);
+				dirty = &pxdirty[k];
+				if(dirty->none()){
+					pxdirtyorder.push_back(k);
+				}
+			}
+			dirty->set((px.y & 0xF) << 4 | (px.x & 0xF));
+			changed = true;
+		}
+		i = end;
+	}
+	if(changed){
+		sched_updates();
+		sched_log();
+	}
+}
+
 void World::setChunkProtection(int32_t x, int32_t y, bool state) {
 	db.setChunkProtection(x, y, state);
+	db.log_protect(x, y, state);
+	sched_log();
 	Chunk * c = get_chunk(x, y);
 	if (c) {
-		c->ranked = state;
+		c->set_ranked(state);
 		uint8_t msg[10] = {CHUNK_PROTECTED};
 		memcpy(&msg[1], (char *)&x, 4);
 		memcpy(&msg[5], (char *)&y, 4);
 		memcpy(&msg[9], (char *)&state, 1);
 		uWS::WebSocket<uWS::SERVER>::PreparedMessage * prep = uWS::WebSocket<uWS::SERVER>::prepareMessage(
 			(char *)&msg[0], sizeof(msg), uWS::BINARY, false);
+		const uint64_t chunk = key64(x, y);
 		for(auto client : clients){
-			client->get_ws().sendPrepared(prep);
+			if(client->is_subscribed(chunk)){
+				client->get_ws().sendPrepared(prep);
+			}
 		}
 		uWS::WebSocket<uWS::SERVER>::finalizeMessage(prep);
 	}
 }
 
 void World::safedelete() {
+	unloading = true;
 	uv_timer_stop(&upd_hdl);
+	shard->get_timers()->cancel(&logtimer);
+	shard->get_timers()->cancel(&cptimer);
+	/* The world could be loaded again before this instance is deleted */
+	save();
+	try_close(); /* Or the last chunk_loaded, flush_log or snapshot will */
+}
+
+void World::try_close() {
+	if(pendingloads.empty() && !logflushing && !snapshots){
+		close();
+	}
+}
+
+void World::close() {
 	uv_close((uv_handle_t *)&upd_hdl, (uv_close_cb)([](uv_handle_t * const t){
 		delete (World *)t->data;
 	}));
@@ -446,10 +1049,257 @@ void World::broadcast(const std::string& msg) const {
 }
 
 void World::save() {
+	/* Older copies of the chunks could be written after these otherwise */
+	db.wait_writes();
 	for(const auto& chunk : chunks){
 		chunk.second->save();
 	}
 	db.save();
+	/* Edits logged up to now are in the region files */
+	db.checkpoint();
+	chunks_queued -= dirtyqueue.size();
+	dirtyqueue.clear();
+	logboundaries.clear();
+}
+
+void World::chunk_changed(Chunk * const c, const int32_t x, const int32_t y) {
+	const uint64_t now = uv_now(shard->get_loop());
+	if(c->mark_dirty(now)){
+		dirtyqueue.emplace_back(key64(x, y), c->get_dirtysince());
+		++chunks_queued;
+		sched_checkpoint();
+	}
+}
+
+void World::sched_checkpoint() {
+	if(!unloading && !cptimer.is_scheduled()){
+		shard->get_timers()->schedule(&cptimer, WORLD_CHECKPOINT_TICK_MSEC);
+	}
+}
+
+void World::checkpoint_timeout(TimerWheel::Timer * const t) {
+	World * const w = (World *)t->data;
+	const uint64_t now = uv_now(w->shard->get_loop());
+	if(w->logged && !w->logflushing && now - w->logstart >= WORLD_LOG_ROTATE_MSEC){
+		w->rotate_log(now);
+	}
+	w->checkpoint(now, WORLD_CHECKPOINT_BUDGET_BYTES);
+	w->drop_logs();
+	if(!w->dirtyqueue.empty() || w->logged){
+		w->sched_checkpoint();
+	}
+}
+
+void World::checkpoint(const uint64_t now, const size_t budget) {
+	if(unloading){
+		return;
+	}
+	const std::shared_ptr<snapshot_t> snap(std::make_shared<snapshot_t>());
+	snap->oldest = UINT64_MAX;
+	while(!dirtyqueue.empty()){
+		const uint64_t since = dirtyqueue.front().second;
+		const uint64_t age = now - since;
+		/* Recently changed chunks are likely to change again, wait to write them once */
+		if(age < WORLD_CHECKPOINT_MIN_AGE_MSEC
+				|| (snap->arena.size() >= budget && age < WORLD_CHECKPOINT_MAX_AGE_MSEC)){
+			break;
+		}
+		const uint64_t k = dirtyqueue.front().first;
+		dirtyqueue.pop_front();
+		--chunks_queued;
+		const auto search = chunks.find(key((int32_t)k, (int32_t)(k >> 32)));
+		if(search != chunks.end() && search->second->get_dirtysince() == since){
+			search->second->stage(*snap);
+		}
+	}
+	write_snapshot(snap);
+}
+
+void World::snapshot() {
+	if(unloading){
+		return;
+	}
+	const std::shared_ptr<snapshot_t> snap(std::make_shared<snapshot_t>());
+	snap->oldest = UINT64_MAX;
+	for(const auto& chunk : chunks){
+		chunk.second->stage(*snap);
+	}
+	chunks_queued -= dirtyqueue.size();
+	dirtyqueue.clear();
+	const uint64_t now = uv_now(shard->get_loop());
+	if(logged && !logflushing){
+		rotate_log(now);
+	}
+	write_snapshot(snap);
+	drop_logs();
+}
+
+void World::compact(const std::function<void(const bool ok, const uint64_t reclaimed, const uint32_t dropped)>& done) {
+	struct result_t {
+		bool ok;
+		uint64_t reclaimed;
+		uint32_t dropped;
+	};
+	const std::shared_ptr<result_t> res(std::make_shared<result_t>());
+	/* The world stays loaded until it's done */
+	++snapshots;
+	db.begin_write();
+	Database * const dbp = &db;
+	const uint32_t clr = bgclr;
+	savepool->queueJob([dbp, clr, res] {
+		res->reclaimed = 0;
+		res->dropped = 0;
+		res->ok = dbp->compact(clr, res->reclaimed, res->dropped);
+		dbp->end_write();
+	}, [this, res, done] {
+		--snapshots;
+		done(res->ok, res->reclaimed, res->dropped);
+		if(unloading){
+			try_close();
+		}
+	}, shard->get_tasks());
+}
+
+void World::write_snapshot(const std::shared_ptr<snapshot_t>& snap) {
+	if(snap->entries.empty()){
+		return;
+	}
+	++snapshots;
+	snapshotoldest.push_back(snap->oldest);
+	db.begin_write();
+	Database * const dbp = &db;
+	savepool->queueJob([dbp, snap] {
+		dbp->write_snapshot(*snap);
+		dbp->end_write();
+	}, [this, snap] {
+		--snapshots;
+		snapshotoldest.pop_front();
+		const uint64_t now = uv_now(shard->get_loop());
+		for(const snapshot_t::entry_t & e : snap->entries){
+			const auto search = chunks.find(key(e.x, e.y));
+			if(e.saved){
+				const uint64_t latency = now - e.since;
+				++chunks_saved;
+				save_latency_total += latency;
+				/* Worlds on other shards could be updating it too */
+				uint64_t max = save_latency_max;
+				while(latency > max && !save_latency_max.compare_exchange_weak(max, latency)) { }
+			}
+			if(search == chunks.end()){
+				continue;
+			}
+			search->second->staged_written(e.version, e.saved);
+			if(!e.saved && search->second->mark_dirty(e.since)){
+				/* Tried again on the next tick */
+				dirtyqueue.emplace_front(key64(e.x, e.y), e.since);
+				++chunks_queued;
+			}
+		}
+		if(unloading){
+			try_close();
+			return;
+		}
+		drop_logs();
+		sched_checkpoint();
+	}, shard->get_tasks());
+}
+
+void World::rotate_log(const uint64_t now) {
+	const std::shared_ptr<WriteAheadLog> wal(db.get_log(false));
+	logged = false;
+	logstart = now;
+	/* Protections logged in the old file */
+	db.save();
+	if(!wal){
+		return;
+	}
+	const std::shared_ptr<std::vector<uint8_t>> tail(std::make_shared<std::vector<uint8_t>>());
+	uint64_t oldsegment;
+	if(!wal->rotate(*tail, oldsegment)){
+		std::cerr << "Could not start a new edit log! (" << strerror(errno) << ")" << std::endl;
+		return;
+	}
+	logboundaries.push_back({oldsegment, now});
+	if(!tail->empty()){
+		/* The save thread drops the file after this, in the same order */
+		savepool->queueJob([wal, tail, oldsegment] {
+			if(!wal->write_to(oldsegment, *tail)){
+				std::cerr << "Could not write the edit log! (" << strerror(errno) << ")" << std::endl;
+			}
+		}, [] { }, shard->get_tasks());
+	}
+}
+
+void World::drop_logs() {
+	/* Edits older than every unsaved chunk's are on the disk */
+	uint64_t saved = dirtyqueue.empty() ? UINT64_MAX : dirtyqueue.front().second;
+	for(const uint64_t oldest : snapshotoldest){
+		saved = std::min(saved, oldest);
+	}
+	uint64_t segment = 0;
+	bool found = false;
+	while(!logboundaries.empty() && logboundaries.front().time < saved){
+		segment = logboundaries.front().segment;
+		found = true;
+		logboundaries.pop_front();
+	}
+	const std::shared_ptr<WriteAheadLog> wal(db.get_log(false));
+	if(!found || !wal){
+		return;
+	}
+	/* Counted like a snapshot, the world (and its database) stays until it's done */
+	++snapshots;
+	db.begin_write();
+	Database * const dbp = &db;
+	savepool->queueJob([dbp, wal, segment] {
+		/* Chunks unloaded since the last snapshot were saved but not flushed */
+		if(!dbp->has_failed() && dbp->sync_files() && !wal->drop(segment)){
+			std::cerr << "Could not remove old edit logs! (" << strerror(errno) << ")" << std::endl;
+		}
+		dbp->end_write();
+	}, [this] {
+		--snapshots;
+		if(unloading){
+			try_close();
+		}
+	}, shard->get_tasks());
+}
+
+void World::sched_log() {
+	logged = true;
+	sched_checkpoint();
+	/* A running flush schedules the next one when it's done */
+	if(!logflushing && !logtimer.is_scheduled()){
+		shard->get_timers()->schedule(&logtimer, WORLD_LOG_SYNC_MSEC);
+	}
+}
+
+void World::log_timeout(TimerWheel::Timer * const t) {
+	((World *)t->data)->flush_log();
+}
+
+void World::flush_log() {
+	const std::shared_ptr<WriteAheadLog> wal(db.get_log());
+	if(!wal || !wal->has_pending()){
+		return;
+	}
+	uint64_t gen;
+	const std::shared_ptr<std::vector<uint8_t>> batch(std::make_shared<std::vector<uint8_t>>(wal->take(gen)));
+	logflushing = true;
+	diskpool->queueJob([wal, batch, gen] {
+		if(!wal->write(*batch, gen)){
+			std::cerr << "Could not write the edit log! (" << strerror(errno) << ")" << std::endl;
+		}
+	}, [this] {
+		logflushing = false;
+		if(unloading){
+			try_close();
+			return;
+		}
+		if(db.get_log()->has_pending()){
+			sched_log();
+		}
+	}, shard->get_tasks());
 }
 
 bool World::is_empty() const {
@@ -472,6 +1322,10 @@ void World::set_default_rank(uint8_t r) {
 	defaultRank = r;
 }
 
+uint32_t World::get_online() const {
+	return online;
+}
+
 std::set<Client *> * World::get_pl() {
 	return &clients;
 }